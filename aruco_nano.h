@@ -23,6 +23,22 @@
  *      auto r_t=m.estimatePose(camMatrix,distCoeff,markerSize);
  * }
  *
+ * For video, create the detector once and reuse it together with the output vector: the working buffers are recycled between frames.
+ * Camera buffers (gray, NV12 or YUYV) can be passed directly without wrapping them in a cv::Mat.
+ *
+ *   aruconano::MarkerDetector detector;
+ *   std::vector<aruconano::Marker> markers;
+ *   while(grabFrame(ptr,width,height,stride))
+ *      detector.detect(aruconano::ImageView(ptr,width,height,stride,aruconano::ImageView::NV12),markers);
+ *
+ * The poses of all the markers of a frame are best computed at once, reusing the estimator and the output vector as well.
+ *
+ *   aruconano::PoseEstimator poseEstimator(camMatrix,distCoeff,markerSize);
+ *   std::vector<aruconano::MarkerPose> poses;
+ *   poseEstimator.estimate(markers,poses);
+ *
+ * Many video streams are processed concurrently with Pipeline, which spreads the stages of the detection of their frames over several threads.
+ *
  * If you use this file in your research, you must cite:
  *
  * 1."Speeded up detection of squared fiducial markers", Francisco J.Romero-Ramirez, Rafael Muñoz-Salinas, Rafael Medina-Carnicer, Image and Vision Computing, vol 76, pages 38-47, year 2018
@@ -54,182 +70,1594 @@ Copyright 2022 Rafael Muñoz Salinas. All rights reserved.
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/calib3d.hpp>
-#include <bitset>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
 namespace aruconano {
 class Marker : public std::vector<cv::Point2f>
 {
 public:
     int id=-1;
     inline void draw(cv::Mat &image,const cv::Scalar color=cv::Scalar(0,0,255))const;
-    inline std::pair<cv::Mat,cv::Mat> estimatePose(cv::Mat cameraMatrix,cv::Mat distCoeffs,double markerSize=1.0f)const;
+    inline std::pair<cv::Mat,cv::Mat> estimatePose(const cv::Mat &cameraMatrix,const cv::Mat &distCoeffs,double markerSize=1.0f)const;
 };
+/** Non-owning view of an 8-bit camera buffer. Only the luminance is used, so for NV12 data must point to the Y plane and for YUYV to the packed frame.
+ * stride is the distance in bytes between rows (0 means tightly packed).
+ */
+struct ImageView{
+    enum Format{GRAY=0,NV12=1,YUYV=2};
+    ImageView(const uchar *data_,int width_,int height_,size_t stride_=0,Format format_=GRAY):data(data_),width(width_),height(height_),stride(stride_),format(format_){}
+    const uchar *data;
+    int width,height;
+    size_t stride;
+    Format format;
+};
+struct DetectorParams{
+    unsigned int maxAttemptsPerCandidate=10;
+    //number of wrong bits a code may have and still be accepted. ARUCO_MIP_36h12 codes are at least 12 bits apart, so up to 5 bits can be corrected unambiguously
+    int maxCorrectionBits=1;
+    /**number of threads used to find, filter and decode the candidates. 1 processes them in the calling thread, 0 uses cv::getNumThreads().
+     * It also sets the tasks the work is split in: min(n,4*nThreads) to filter n contours or decode n quads, and with the FUSED segmentation
+     * nThreads bands of rows and nThreads groups of boundaries to trace. With an executor, these are the tasks it is given
+     */
+    int nThreads=1;
+    /**runs task(0),...,task(nTasks-1), possibly concurrently, and returns once all of them are done. Set it to dispatch the work to your own
+     * thread pool: it then runs every task, whatever nThreads is. If empty, cv::parallel_for_ is used when nThreads is not 1
+     */
+    typedef std::function<void(int nTasks,const std::function<void(int)> &task)> Executor;
+    Executor executor;
+    /**if >1, the candidates are searched in the image downscaled by this factor, and then decoded and refined at full resolution.
+     * Speeds up high resolution images whose markers are large
+     */
+    float decimation=1;
+    //if >0, overrides decimation with the largest one that still finds markers whose sides are this long (in full resolution pixels)
+    int minMarkerSize=0;
+    //how the sampled cells are binarized: against their mean, or with Otsu's method, better when black and white cells are unbalanced
+    enum CellThreshold{MEAN=0,OTSU=1};
+    CellThreshold cellThreshold=MEAN;
+    /**how the candidates are found: cv::adaptiveThreshold followed by cv::findContours, or a single pass that thresholds bands of rows and only
+     * traces the boundaries of the blobs that may be markers. FUSED finds the same quads as cv::findContours, holes included, with less memory
+     * traffic and in parallel
+     */
+    enum Segmentation{CONTOURS=0,FUSED=1};
+    Segmentation segmentation=CONTOURS;
+    //if set, the detector measures its stages and counts the candidates they discard, see MarkerDetector::stats()
+    bool collectStats=false;
+};
+/** Where the last detection spent its time and discarded its candidates. Times are in seconds, those of the stages that run in parallel being
+ * summed over their tasks.
+ */
+struct DetectorStats{
+    double convertTime=0,thresholdTime=0,contoursTime=0,polygonTime=0,decodeTime=0,refineTime=0;
+    size_t nContours=0;//contours found, or blobs and holes with the FUSED segmentation
+    size_t nSmall=0;//contours too short to be a marker
+    size_t nNotQuads=0;//contours whose polygon is not a convex quad
+    size_t nDecodeAttempts=0;
+    size_t nUndecoded=0;//quads that did not match any code in any attempt
+    size_t nDuplicates=0;//markers found more than once, by overlapping regions or nested contours
+    size_t nMarkers=0;
+    DetectorStats &operator+=(const DetectorStats &other){
+        convertTime+=other.convertTime;thresholdTime+=other.thresholdTime;contoursTime+=other.contoursTime;
+        polygonTime+=other.polygonTime;decodeTime+=other.decodeTime;refineTime+=other.refineTime;
+        nContours+=other.nContours;nSmall+=other.nSmall;nNotQuads+=other.nNotQuads;nDecodeAttempts+=other.nDecodeAttempts;
+        nUndecoded+=other.nUndecoded;nDuplicates+=other.nDuplicates;nMarkers+=other.nMarkers;
+        return *this;
+    }
+};
+namespace _private {
+struct Candidate{
+    cv::Point2f corners[4];
+    int id=-1;
+    int perimeter=0;
+    //index of the contour it comes from, which seeds the jitter of the decoding retries so that it does not depend on the thread decoding it
+    size_t index=0;
+    float jitter=0;
+};
+//scratch buffers of a candidate processing task, so that tasks can run concurrently
+struct Workspace{
+    std::vector<cv::Point> maybeCorners;
+    std::vector<Candidate> quads,candidates;
+    DetectorStats stats;
+};
+inline double secondsSince(int64 start){
+    return double(cv::getTickCount()-start)/cv::getTickFrequency();
+}
+//all four rotations of every code of a dictionary, hashed for exact lookups and stored contiguously for nearest neighbour searches
+class DictionaryIndex{
+public:
+    inline DictionaryIndex(const uint64_t *codes,int nCodes,int nBits);
+    /**returns the id of the code nearest to code (or -1 if none is within maxCorrectionBits), the number of 90 degree clockwise rotations
+     * that turn code into it, and their Hamming distance
+     */
+    inline int find(uint64_t code,int maxCorrectionBits,int &nRotations,int &distance)const;
+    int size()const{return _nCodes;}
+    uint64_t code(int id)const{return _rotatedCodes[id];}
+private:
+    static inline uint64_t rotate(uint64_t code,int nBits);
+    inline uint16_t &slot(uint64_t code);
+    int _nCodes;
+    std::vector<uint64_t> _rotatedCodes;//rotation major: entry r*_nCodes+id is code id rotated r times counter clockwise
+    std::vector<uint16_t> _table;//open addressing hash table storing 1+index in _rotatedCodes, 0 meaning empty
+};
+/** Finds the quads that cv::adaptiveThreshold(MEAN_C,7,7), cv::findContours and cv::approxPolyDP would, without the intermediate images.
+ * Bands of rows are thresholded with running sums and turned into runs of foreground pixels while still in cache, the runs are joined into
+ * 8-connected blobs and the gaps between them into 4-connected holes, and only the boundaries of the blobs large enough, outer and hole
+ * ones, are traced, giving up as soon as they get too long for a quad.
+ */
+class QuadSegmenter{
+public:
+    struct Quad{
+        cv::Point corners[4];
+    };
+    //finds the convex quads approximating the blob boundaries of at least minContourSize pixels, splitting the work in a task per thread
+    //if stats is not null, the times and counts of the segmentation are added to it
+    inline void segment(const cv::Mat &grayImg,int minContourSize,int nThreads,const DetectorParams::Executor &executor,DetectorStats *stats=nullptr);
+    const std::vector<Quad> &quads()const{return _quads;}
+private:
+    struct Run{
+        int x0,x1,y;//foreground pixels x0..x1 of row y
+    };
+    struct Blob{
+        int run;//the first one in raster order, whose first pixel starts the outer boundary
+        int area;//pixels
+    };
+    struct Gap{
+        int x0,x1;//background pixels x0..x1 of a row
+        int run;//the one on its left, -1 if none
+    };
+    struct Boundary{
+        cv::Point start;//first pixel of the blob in raster order, or the one left of the first pixel of the hole
+        int area;//of the blob, which bounds the length of the boundary
+        bool hole;
+    };
+    struct Task{
+        std::vector<int> columnSums;
+        std::vector<Run> runs;
+        std::vector<cv::Point> contour,approx;
+        std::vector<Quad> quads;
+        DetectorStats stats;
+    };
+    inline void thresholdBand(const cv::Mat &grayImg,int y0,int y1,Task &task);
+    inline void findHoles(int rows,int cols);
+    inline void traceBoundaries(size_t begin,size_t end,int minContourSize,bool collectStats,Task &task)const;
+    static inline int findRoot(std::vector<int> &parents,int i);
+    static inline bool traceBoundary(const uchar *binary,int stride,cv::Point start,bool hole,size_t maxLength,std::vector<cv::Point> &contour);
+
+    cv::Mat _binary;//thresholded image framed by 1 background pixel, so that boundaries are traced without bounds checks
+    std::vector<Task> _tasks;
+    std::vector<Run> _runs;
+    std::vector<int> _rowStarts,_parents,_labels;
+    std::vector<Blob> _blobs;
+    std::vector<Gap> _gaps;
+    std::vector<int> _gapRowStarts,_gapParents,_holes;
+    std::vector<uchar> _outside;
+    std::vector<Boundary> _boundaries;
+    std::vector<Quad> _quads;
+};
+}
+namespace _private {
+//single producer single consumer ring buffer. Neither push nor pop blocks: they fail if the queue is full or empty
+template<typename T> class SpscQueue{
+public:
+    //empties the queue, which must not be in use
+    void reset(size_t capacity){
+        _buffer.assign(capacity+1,T());
+        _head.index=0;
+        _tail.index=0;
+    }
+    bool push(const T &value){
+        size_t tail=_tail.index.load(std::memory_order_relaxed),next=tail+1==_buffer.size()?0:tail+1;
+        if(next==_head.index.load(std::memory_order_acquire)) return false;
+        _buffer[tail]=value;
+        _tail.index.store(next,std::memory_order_release);
+        return true;
+    }
+    bool pop(T &value){
+        size_t head=_head.index.load(std::memory_order_relaxed);
+        if(head==_tail.index.load(std::memory_order_acquire)) return false;
+        value=_buffer[head];
+        _head.index.store(head+1==_buffer.size()?0:head+1,std::memory_order_release);
+        return true;
+    }
+    bool empty()const{return _head.index.load(std::memory_order_acquire)==_tail.index.load(std::memory_order_acquire);}
+private:
+    //head and tail are written by different threads, so they are kept in different cache lines
+    struct Index{
+        std::atomic<size_t> index{0};
+        char padding[64-sizeof(std::atomic<size_t>)];
+    };
+    std::vector<T> _buffer;
+    Index _head,_tail;
+};
+}
 class MarkerDetector{
+    friend class Pipeline;
 public:
+    MarkerDetector(const DetectorParams &params=DetectorParams()):_params(params){
+        _params.maxAttemptsPerCandidate=std::max(1u,_params.maxAttemptsPerCandidate);
+        _params.maxCorrectionBits=std::max(0,std::min(5,_params.maxCorrectionBits));
+    }
+    /** Detects the markers in img and writes them into markers. The detector keeps and reuses its own working buffers between calls,
+     * and those of markers if it is reused as well, so they stop growing once frames of the same size have been processed. The OpenCV
+     * functions it calls (thresholding, contours, corner refinement, parallel_for_) may still allocate internally.
+     */
+    inline void detect(const cv::Mat &img,std::vector<Marker> &markers);
+    inline void detect(const ImageView &img,std::vector<Marker> &markers);
+    //same as above, but the markers are only searched inside the given regions of the image, so none are found if rois is empty
+    inline void detect(const cv::Mat &img,const std::vector<cv::Rect> &rois,std::vector<Marker> &markers);
+    inline void detect(const ImageView &img,const std::vector<cv::Rect> &rois,std::vector<Marker> &markers);
+    //stages of the last detection, only measured if DetectorParams::collectStats is set
+    const DetectorStats &stats()const{return _stats;}
+    //image of marker id, black border included, with cells of cellSize pixels. Empty if the dictionary has no such id
+    static inline cv::Mat markerImage(int id,int cellSize=10);
     static inline std::vector<Marker> detect(const cv::Mat &img,unsigned int maxAttemptsPerCandidate=10){
-        return detectInternal( img,maxAttemptsPerCandidate);
+        std::vector<Marker> markers;
+        DetectorParams params;
+        params.maxAttemptsPerCandidate=maxAttemptsPerCandidate;
+        MarkerDetector(params).detect(img,markers);
+        return markers;
     }
 private:
-    static inline std::vector<Marker> detectInternal(const cv::Mat &inputImg,unsigned int _469b059f634d94c9e4ec3cbfa661e4d400db2637140ddd3b223a6a266e38afcf=10);
-    static inline  Marker _32674b0393ce09cbb2335aaefa8ef8579e14890d49ea4a6034287e01ed3da198( const  Marker &_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e);
-    static inline  float  _24b3b2c1ce549055e1ea87fa3e826a5ae86ed517e4756d42f981aefeb14f6b7c(const cv::Mat &_a0928816cc7978aa29fd5c1e99af8f9ec59ac527b07592389ad0606372d79f5f,const cv::Point2f &_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940);
-    static inline  int    _c6c1144f4f3ead4057b05bfa0496c6698e2fdb4dc7074a4fad79e6b49aa65f8d(const cv::Mat &_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814,int &_0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949,const std::vector<uint64_t> &_6ab47d70854a8c690a0c2035be903f3d812cbab06f9e442e9b10ad70b1acd446);
-    static inline  int    _9a5e8aa400939eed2bf8f56c0174c17afd0e20f2c77f51286176859429b9f84a(const std::vector<cv::Point2f>& _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb);
+    //if rois is not null, only the pixels the detection in them reads are converted
+    inline const cv::Mat &toGray(const cv::Mat &img,const std::vector<cv::Rect> *rois);
+    inline cv::Mat toGray(const ImageView &img,const std::vector<cv::Rect> *rois);
+    inline cv::Rect grayRegion(const cv::Rect &roi,cv::Size imgSize)const;
+    //rois is null to search the whole image
+    template<typename Image> inline void detectImage(const Image &img,const std::vector<cv::Rect> *rois,std::vector<Marker> &markers);
+    inline void detectInternal(const cv::Mat &grayImg,const std::vector<cv::Rect> *rois,std::vector<Marker> &markers);
+    //the two halves of a detection, which Pipeline runs in different threads: finding the quads that may be markers, and decoding and refining them
+    inline void findQuads(const cv::Mat &grayImg,const std::vector<cv::Rect> *rois,std::vector<_private::Candidate> &quads);
+    inline void decodeQuads(const cv::Mat &grayImg,const std::vector<_private::Candidate> &quads,std::vector<Marker> &markers);
+    inline void findRoiQuads(const cv::Mat &grayImg,const cv::Rect &roi,float decimation,std::vector<_private::Candidate> &quads);
+    inline void filterContours(size_t begin,size_t end,_private::Workspace &workspace)const;
+    inline void decodeCandidates(size_t begin,size_t end,const cv::Mat &grayImg,const std::vector<_private::Candidate> &quads,_private::Workspace &workspace)const;
+    inline float decimation()const;
+    inline int nThreads()const;
+    //tasks the processing of nItems is split in, several per thread to balance their load, or a single one if it runs in the calling thread
+    inline int nTasks(size_t nItems)const;
+    inline _private::Candidate makeCandidate(const cv::Point quad[4],size_t index)const;
+    static inline void sortCorners(cv::Point2f corners[4]);
+    static inline uint64_t sampleBits(const cv::Mat &grayImg,const cv::Point2f corners[4],DetectorParams::CellThreshold cellThreshold);
+    static inline int getMarkerId(uint64_t bits,int &nRotations,int maxCorrectionBits);
+    static inline int perimeter(const cv::Point2f corners[4]);
+    static inline const _private::DictionaryIndex &arucoMip36h12();
+
+    DetectorParams _params;
+    cv::Mat _grayMat,_decimatedMat,_thresholdedMat;
+    std::vector<std::vector<cv::Point>> _contours;
+    _private::QuadSegmenter _segmenter;
+    cv::Point2f _contoursScale,_contoursOffset;//from the image the contours are extracted from to the full resolution one
+    std::vector<_private::Workspace> _workspaces;
+    std::vector<_private::Candidate> _quads,_candidates;
+    std::vector<Marker> _spareMarkers;
+    DetectorStats _stats;
+};
+struct TrackerParams{
+    //a full image detection, which finds the markers entering the scene, is done every this many frames
+    int fullDetectionInterval=15;
+    //the region searched for a marker is its predicted bounding box enlarged on each side by this fraction of the marker size
+    float roiMargin=0.5f;
+};
+/** Detects markers in video searching only around the positions predicted from the previous frames, so that the time per frame depends on the
+ * number of markers rather than on the image size. A full image detection is done periodically and whenever a tracked marker is not found.
+ *
+ *   aruconano::MarkerTracker tracker;
+ *   std::vector<aruconano::Marker> markers;
+ *   while(video.read(frame))
+ *      tracker.track(frame,markers);
+ */
+class MarkerTracker{
+public:
+    MarkerTracker(const DetectorParams &detectorParams=DetectorParams(),const TrackerParams &params=TrackerParams()):_detector(detectorParams),_params(params){}
+    inline void track(const cv::Mat &img,std::vector<Marker> &markers);
+    inline void track(const ImageView &img,std::vector<Marker> &markers);
+    //forgets the tracked markers, so that the next frame is a full image detection
+    void reset(){_tracks.clear();}
+private:
+    struct Track{
+        int id;
+        cv::Point2f corners[4],velocity[4];
+    };
+    template<typename Image> inline void trackInternal(const Image &img,cv::Size imgSize,std::vector<Marker> &markers);
+    inline void update(const std::vector<Marker> &markers);
+    MarkerDetector _detector;
+    TrackerParams _params;
+    std::vector<Track> _tracks,_previousTracks;
+    std::vector<cv::Rect> _rois;
+    cv::Size _imgSize;
+    int _frameCount=0;
+};
+//pose of a marker, as the rvec and tvec of cv::solvePnP
+struct MarkerPose{
+    int id=-1;
+    cv::Vec3d rvec,tvec;
+    double reprojectionError=0;//root mean square distance between the corners and their projections, in pixels. Infinite if the pose failed
+};
+//corners of a marker of a rigid board in the board coordinate system, in the same order as those of Marker
+struct BoardMarker{
+    int id;
+    cv::Point3f corners[4];
+};
+/** Computes the poses of all the markers of a frame at once. Their corners are undistorted in a single call and the pose of each marker is
+ * obtained in closed form with the IPPE method, as cv::solvePnP(SOLVEPNP_IPPE) does, but without allocations once the buffers have grown.
+ */
+class PoseEstimator{
+public:
+    inline PoseEstimator(const cv::Mat &cameraMatrix,const cv::Mat &distCoeffs,double markerSize=1);
+    //writes in poses[i] the pose of markers[i]
+    inline void estimate(const std::vector<Marker> &markers,std::vector<MarkerPose> &poses);
+    /** fits a single pose of the board to the corners of all its markers found. Returns the number of markers used, so the pose is only valid
+     * if it is not 0
+     */
+    inline int estimateBoard(const std::vector<Marker> &markers,const std::vector<BoardMarker> &board,cv::Vec3d &rvec,cv::Vec3d &tvec);
+private:
+    inline void undistort(const std::vector<Marker> &markers);
+    //pose of a marker from its normalized corners, returning the sum of squared reprojection errors in normalized coordinates
+    inline double solveIppe(const cv::Point2f normalized[4],double R[9],double t[3])const;
+    cv::Mat _cameraMatrix,_distCoeffs;
+    double _markerSize,_focalLength;
+    std::vector<cv::Point2f> _corners,_normalized,_boardImagePoints;
+    std::vector<cv::Point3f> _boardObjectPoints;
+};
+struct PipelineParams{
+    int nStreams=1;
+    /**frames of each stream that can be in the pipeline at once. While all of them are busy push fails, unless the oldest one still waiting
+     * for its candidates or decoding has waited longer than the latency budget: push then takes over its buffer, and it is delivered dropped
+     */
+    int maxFramesInFlight=4;
+    //threads of each stage, each one serving the streams whose index modulo nWorkers is its own. 0 chooses it from the number of cores
+    int nWorkers=0;
+    /**seconds a frame may wait. A frame older than this is dropped before finding or decoding its candidates if a newer frame of its stream is
+     * already queued behind it, or pushed while all the frames are busy. 0 never drops
+     */
+    double latencyBudget=0;
+    //if cameraMatrix is set, the poses of the markers are estimated too
+    cv::Mat cameraMatrix,distCoeffs;
+    double markerSize=1;
+};
+//outcome of a frame pushed into a Pipeline
+struct FrameResult{
+    int stream=0;
+    uint64_t frame=0;//index of the frame in its stream, in push order
+    bool dropped=false;//skipped to keep within the latency budget, without markers
+    double latency=0;//seconds from push to delivery
+    std::vector<Marker> markers;
+    std::vector<MarkerPose> poses;
+};
+/** Detects the markers of many streams concurrently, overlapping the stages of their detections. push converts the frame to gray into a
+ * buffer of the pipeline, and then the frame goes through the candidates, decoding and pose stages, each one with its own threads, connected
+ * by lock-free queues. A stream is served by a single thread in each stage, so its results are delivered in push order, dropped frames
+ * included, through the callback, which is called from the pose stage threads.
+ *
+ *   aruconano::PipelineParams params;
+ *   params.nStreams=cameras.size();
+ *   aruconano::Pipeline pipeline(params,aruconano::DetectorParams(),[](const aruconano::FrameResult &result){ ... });
+ *   //in the thread of camera i
+ *   while(cameras[i].read(frame))
+ *      pipeline.push(i,frame);
+ */
+class Pipeline{
+public:
+    typedef std::function<void(const FrameResult &result)> Callback;
+    inline Pipeline(const PipelineParams &params,const DetectorParams &detectorParams,const Callback &callback);
+    //delivers the frames in flight before returning
+    inline ~Pipeline();
+    /** queues a frame of stream. The frames of a stream must be pushed from a single thread, and the image is copied, so it can be reused right
+     * away. If all the maxFramesInFlight frames of the stream are busy, the oldest one that has not been decoded yet is dropped to make room for
+     * this one, provided it was pushed more than latencyBudget seconds ago. Returns false, without queueing it, if there is no such frame, no
+     * budget, or as many dropped frames waiting to be delivered as maxFramesInFlight
+     */
+    inline bool push(int stream,const cv::Mat &img);
+    inline bool push(int stream,const ImageView &img);
+    //waits until all the frames pushed have been delivered. Not to be called from the callback
+    inline void flush();
+private:
+    enum Stage{CANDIDATES=0,DECODE=1,POSE=2,N_STAGES=3};
+    //the state of a frame waiting for a stage is that stage
+    enum State{RUNNING=N_STAGES,FREE=N_STAGES+1};
+    /**buffers of a frame. push takes over those of a frame waiting for its candidates or decoding by moving it out of its waiting state, so a
+     * worker only processes a frame after moving it from waiting to RUNNING itself
+     */
+    struct Frame{
+        cv::Mat gray;
+        std::vector<_private::Candidate> quads;
+        FrameResult result;
+        std::atomic<uint64_t> index{0};//the frame of the stream using the buffers
+        std::atomic<int> state{FREE};
+        int64 pushTick=0;//when that frame was pushed. Only push uses it
+    };
+    //what the queues pass between the stages. A frame whose buffers were taken over still goes through them, to be delivered dropped in order
+    struct Token{
+        Frame *frame;
+        uint64_t index;
+        int64 pushTick;
+        bool evicted;
+    };
+    struct Stream{
+        explicit Stream(int nFrames):frames(nFrames){
+            free.reset(nFrames);
+            for(auto &queue:queues) queue.reset(maxTokens());
+        }
+        //frames in flight, evicted ones included, which are bounded so that the queues never overflow
+        int maxTokens()const{return 2*int(frames.size());}
+        std::vector<Frame> frames;
+        _private::SpscQueue<Frame*> free;//the frames available to push
+        _private::SpscQueue<Token> queues[N_STAGES];//those waiting for each stage
+        std::atomic<int> nTokens{0};
+        uint64_t nPushed=0;
+    };
+    struct Worker{
+        explicit Worker(const DetectorParams &detectorParams):detector(detectorParams){}
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wakeUp;
+        std::atomic<bool> sleeping{false};
+        MarkerDetector detector;
+        std::unique_ptr<PoseEstimator> poseEstimator;
+        FrameResult evictedResult;
+    };
+    inline Frame *acquire(int stream);
+    inline void submit(Frame *frame);
+    inline void enqueue(int stage,const Token &token);
+    inline void run(int stage,int worker);
+    inline void process(int stage,Worker &worker,const Token &token);
+    inline void delivered(int stream);
+
+    PipelineParams _params;
+    Callback _callback;
+    std::vector<std::unique_ptr<Stream>> _streams;
+    std::vector<std::unique_ptr<Worker>> _workers[N_STAGES];
+    std::atomic<bool> _stop{false};
+    std::atomic<int> _nInFlight{0};
+    //signalled by the pose stage when the last frame in flight is delivered
+    std::mutex _flushMutex;
+    std::condition_variable _flushed;
 };
 namespace _private {
-struct someStruct{
-    someStruct(const std::vector<cv::Point2f> & someVecPoint2f ){
-        std::vector<cv::Point2f>  _582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf={cv::Point2f(0,0),cv::Point2f(1,0),cv::Point2f(1,1),cv::Point2f(0,1)};
-        someMat=cv::getPerspectiveTransform(_582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf, someVecPoint2f);
-    }
-    cv::Point2f operator()(const cv::Point2f &_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940){
-        double *_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a=someMat.ptr<double>(0);
-        double _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb=_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[0]*_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x+_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[1]*_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.y+_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[2];
-        double _3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d=_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[3]*_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x+_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[4]*_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.y+_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[5];
-        double _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6=_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[6]*_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x+_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[7]*_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.y+_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a[8];
-        return cv::Point2f(_ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb/_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6,_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d/_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6);
-    }
-    cv::Mat someMat;
-};
-}
-std::vector<Marker>  MarkerDetector::detectInternal(const cv::Mat &inputImg, unsigned int _469b059f634d94c9e4ec3cbfa661e4d400db2637140ddd3b223a6a266e38afcf){
-     if(_469b059f634d94c9e4ec3cbfa661e4d400db2637140ddd3b223a6a266e38afcf==0) _469b059f634d94c9e4ec3cbfa661e4d400db2637140ddd3b223a6a266e38afcf=1;
-    cv::Mat cvtColorOutputMat,thresholdedMat;
-    std::vector<Marker> vectorMarkers;
-    std::vector<uint64_t> _db7e14922f41551446af8c0626ced0635800af67f5cc656e00a5bd3db8c13508={0xd2b63a09dUL,0x6001134e5UL,0x1206fbe72UL,0xff8ad6cb4UL,0x85da9bc49UL,0xb461afe9cUL,0x6db51fe13UL,0x5248c541fUL,0x8f34503UL,0x8ea462eceUL,0xeac2be76dUL,0x1af615c44UL,0xb48a49f27UL,0x2e4e1283bUL,0x78b1f2fa8UL,0x27d34f57eUL,0x89222fff1UL,0x4c1669406UL,0xbf49b3511UL,0xdc191cd5dUL,0x11d7c3f85UL,0x16a130e35UL,0xe29f27effUL,0x428d8ae0cUL,0x90d548477UL,0x2319cbc93UL,0xc3b0c3dfcUL,0x424bccc9UL,0x2a081d630UL,0x762743d96UL,0xd0645bf19UL,0xf38d7fd60UL,0xc6cbf9a10UL,0x3c1be7c65UL,0x276f75e63UL,0x4490a3f63UL,0xda60acd52UL,0x3cc68df59UL,0xab46f9daeUL,0x88d533d78UL,0xb6d62ec21UL,0xb3c02b646UL,0x22e56d408UL,0xac5f5770aUL,0xaaa993f66UL,0x4caa07c8dUL,0x5c9b4f7b0UL,0xaa9ef0e05UL,0x705c5750UL,0xac81f545eUL,0x735b91e74UL,0x8cc35cee4UL,0xe44694d04UL,0xb5e121de0UL,0x261017d0fUL,0xf1d439eb5UL,0xa1a33ac96UL,0x174c62c02UL,0x1ee27f716UL,0x8b1c5ece9UL,0x6a05b0c6aUL,0xd0568dfcUL,0x192d25e5fUL,0x1adbeccc8UL,0xcfec87f00UL,0xd0b9dde7aUL,0x88dcef81eUL,0x445681cb9UL,0xdbb2ffc83UL,0xa48d96df1UL,0xb72cc2e7dUL,0xc295b53fUL,0xf49832704UL,0x9968edc29UL,0x9e4e1af85UL,0x8683e2d1bUL,0x810b45c04UL,0x6ac44bfe2UL,0x645346615UL,0x3990bd598UL,0x1c9ed0f6aUL,0xc26729d65UL,0x83993f795UL,0x3ac05ac5dUL,0x357adff3bUL,0xd5c05565UL,0x2f547ef44UL,0x86c115041UL,0x640fd9e5fUL,0xce08bbcf7UL,0x109bb343eUL,0xc21435c92UL,0x35b4dfce4UL,0x459752cf2UL,0xec915b82cUL,0x51881eed0UL,0x2dda7dc97UL,0x2e0142144UL,0x42e890f99UL,0x9a8856527UL,0x8e80d9d80UL,0x891cbcf34UL,0x25dd82410UL,0x239551d34UL,0x8fe8f0c70UL,0x94106a970UL,0x82609b40cUL,0xfc9caf36UL,0x688181d11UL,0x718613c08UL,0xf1ab7629UL,0xa357bfc18UL,0x4c03b7a46UL,0x204dedce6UL,0xad6300d37UL,0x84cc4cd09UL,0x42160e5c4UL,0x87d2adfa8UL,0x7850e7749UL,0x4e750fc7cUL,0xbf2e5dfdaUL,0xd88324da5UL,0x234b52f80UL,0x378204514UL,0xabdf2ad53UL,0x365e78ef9UL,0x49caa6ca2UL,0x3c39ddf3UL,0xc68c5385dUL,0x5bfcbbf67UL,0x623241e21UL,0xabc90d5ccUL,0x388c6fe85UL,0xda0e2d62dUL,0x10855dfe9UL,0x4d46efd6bUL,0x76ea12d61UL,0x9db377d3dUL,0xeed0efa71UL,0xe6ec3ae2fUL,0x441faee83UL,0xba19c8ff5UL,0x313035eabUL,0x6ce8f7625UL,0x880dab58dUL,0x8d3409e0dUL,0x2be92ee21UL,0xd60302c6cUL,0x469ffc724UL,0x87eebeed3UL,0x42587ef7aUL,0x7a8cc4e52UL,0x76a437650UL,0x999e41ef4UL,0x7d0969e42UL,0xc02baf46bUL,0x9259f3e47UL,0x2116a1dc0UL,0x9f2de4d84UL,0xeffac29UL,0x7b371ff8cUL,0x668339da9UL,0xd010aee3fUL,0x1cd00b4c0UL,0x95070fc3bUL,0xf84c9a770UL,0x38f863d76UL,0x3646ff045UL,0xce1b96412UL,0x7a5d45da8UL,0x14e00ef6cUL,0x5e95abfd8UL,0xb2e9cb729UL,0x36c47dd7UL,0xb8ee97c6bUL,0xe9e8f657UL,0xd4ad2ef1aUL,0x8811c7f32UL,0x47bde7c31UL,0x3adadfb64UL,0x6e5b28574UL,0x33e67cd91UL,0x2ab9fdd2dUL,0x8afa67f2bUL,0xe6a28fc5eUL,0x72049cdbdUL,0xae65dac12UL,0x1251a4526UL,0x1089ab841UL,0xe2f096ee0UL,0xb0caee573UL,0xfd6677e86UL,0x444b3f518UL,0xbe8b3a56aUL,0x680a75cfcUL,0xac02baea8UL,0x97d815e1cUL,0x1d4386e08UL,0x1a14f5b0eUL,0xe658a8d81UL,0xa3868efa7UL,0x3668a9673UL,0xe8fc53d85UL,0x2e2b7edd5UL,0x8b2470f13UL,0xf69795f32UL,0x4589ffc8eUL,0x2e2080c9cUL,0x64265f7dUL,0x3d714dd10UL,0x1692c6ef1UL,0x3e67f2f49UL,0x5041dad63UL,0x1a1503415UL,0x64c18c742UL,0xa72eec35UL,0x1f0f9dc60UL,0xa9559bc67UL,0xf32911d0dUL,0x21c0d4ffcUL,0xe01cef5b0UL,0x4e23a3520UL,0xaa4f04e49UL,0xe1c4fcc43UL,0x208e8f6e8UL,0x8486774a5UL,0x9e98c7558UL,0x2c59fb7dcUL,0x9446a4613UL,0x8292dcc2eUL,0x4d61631UL,0xd05527809UL,0xa0163852dUL,0x8f657f639UL,0xcca6c3e37UL,0xcb136bc7aUL,0xfc5a83e53UL,0x9aa44fc30UL,0xbdec1bd3cUL,0xe020b9f7cUL,0x4b8f35fb0UL,0xb8165f637UL,0x33dc88d69UL,0x10a2f7e4dUL,0xc8cb5ff53UL,0xde259ff6bUL,0x46d070dd4UL,0x32d3b9741UL,0x7075f1c04UL,0x4d58dbea0UL};
-    if(inputImg.channels()==3)
-        cv::cvtColor(inputImg,cvtColorOutputMat,cv::COLOR_BGR2GRAY);
-    else cvtColorOutputMat=inputImg;
-    cv::adaptiveThreshold(cvtColorOutputMat, thresholdedMat, 255.,cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV, 7, 7);
-    std::vector<std::vector<cv::Point>> contours;
-    std::vector<cv::Point> maybeCorners;
-    cv::RNG cvRng;
-    cv::findContours(thresholdedMat, contours, cv::noArray(), cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
-    cv::Mat _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814(8,8,CV_8UC1);
-    for (unsigned int i = 0; i < contours.size(); i++)
-    {
-        if (50 > int(contours[i].size())  ) continue;
-        cv::approxPolyDP(contours[i], maybeCorners, double(contours[i].size()) * 0.05, true);
-        if (maybeCorners.size() != 4 || !cv::isContourConvex(maybeCorners)) continue;
-        Marker _ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e;
-        for (int _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7 = 0; _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7 < 4; _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7++)
-            _ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.push_back( cv::Point2f( maybeCorners[_189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7].x,maybeCorners[_189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7].y));
-        _ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e=_32674b0393ce09cbb2335aaefa8ef8579e14890d49ea4a6034287e01ed3da198(_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e);
-        for(int _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7=0;_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7<_469b059f634d94c9e4ec3cbfa661e4d400db2637140ddd3b223a6a266e38afcf && _ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.id==-1;_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7++){
-            auto _00a6580137a3a1ab1158cfb7f034486e74b561dbbeb40a375596dc0068c7b403=_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e;
-            if( _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7!=0) for(int _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6=0;_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6<4;_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6++) {_00a6580137a3a1ab1158cfb7f034486e74b561dbbeb40a375596dc0068c7b403[_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6].x+=cvRng.gaussian(0.75);_00a6580137a3a1ab1158cfb7f034486e74b561dbbeb40a375596dc0068c7b403[_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6].y+=cvRng.gaussian(0.75);}
-            int _7f37ee151651a29d62611f7f42d362430ee2d006222698ce75fb948778d632a4=0;
-            _private::someStruct _75239d03c9a8bd9381c16b0d78a21a1493b1d2ab982da8824ef068471ff96020(_00a6580137a3a1ab1158cfb7f034486e74b561dbbeb40a375596dc0068c7b403);
-            for(int _454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1=0;_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1<_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.rows;_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1++){
-                for(int _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6=0;_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6<_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.cols;_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6++){
-                    auto _2461c6d196d702d3c1efb2d040757503eedd64b89a2ca10ac4a37ec3a1e31169=uchar(0.5+_24b3b2c1ce549055e1ea87fa3e826a5ae86ed517e4756d42f981aefeb14f6b7c(cvtColorOutputMat,_75239d03c9a8bd9381c16b0d78a21a1493b1d2ab982da8824ef068471ff96020(cv::Point2f(  float(_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6+0.5) / float(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.cols) ,  float(_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1+0.5) / float(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.rows)  ))));
-                    _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.at<uchar>(_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1,_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6)=_2461c6d196d702d3c1efb2d040757503eedd64b89a2ca10ac4a37ec3a1e31169;
-                    _7f37ee151651a29d62611f7f42d362430ee2d006222698ce75fb948778d632a4+=_2461c6d196d702d3c1efb2d040757503eedd64b89a2ca10ac4a37ec3a1e31169;
-                }
-            }
-            double _82523faea1b0f2da676a0561d597000bb6918036c6e541dc1145966141864332=double(_7f37ee151651a29d62611f7f42d362430ee2d006222698ce75fb948778d632a4)/double(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.cols*_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.rows);
-            cv::threshold(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814,_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814,_82523faea1b0f2da676a0561d597000bb6918036c6e541dc1145966141864332,255,cv::THRESH_BINARY);
-            int _0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949=0;
-            _ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.id=_c6c1144f4f3ead4057b05bfa0496c6698e2fdb4dc7074a4fad79e6b49aa65f8d(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814,_0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949,_db7e14922f41551446af8c0626ced0635800af67f5cc656e00a5bd3db8c13508);
-            if(_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.id==-1) continue;
-            std::rotate(_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.begin(),_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.begin() + 4 - _0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949,_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.end());
-        }
-        if(_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e.id!=-1) vectorMarkers.push_back(_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e);
-    }
-    std::sort(vectorMarkers.begin(), vectorMarkers.end(),[](const Marker &_ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb,const Marker &_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d){
-        if( _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb.id<_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d.id) return true;
-        else if( _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb.id==_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d.id) return _9a5e8aa400939eed2bf8f56c0174c17afd0e20f2c77f51286176859429b9f84a(_ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb)>_9a5e8aa400939eed2bf8f56c0174c17afd0e20f2c77f51286176859429b9f84a(_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d);
+//maps the unit square onto a quad. Closed form of cv::getPerspectiveTransform for this case, so it needs no allocations
+struct Homography{
+    Homography(const cv::Point2f quad[4] ){
+        double sx=quad[0].x-quad[1].x+quad[2].x-quad[3].x, sy=quad[0].y-quad[1].y+quad[2].y-quad[3].y;
+        double dx1=quad[1].x-quad[2].x, dx2=quad[3].x-quad[2].x, dy1=quad[1].y-quad[2].y, dy2=quad[3].y-quad[2].y;
+        double den=dx1*dy2-dx2*dy1;
+        double g=0,h=0;
+        if(den!=0){
+            g=(sx*dy2-dx2*sy)/den;
+            h=(dx1*sy-sx*dy1)/den;
+        }
+        H[0]=quad[1].x-quad[0].x+g*quad[1].x; H[1]=quad[3].x-quad[0].x+h*quad[3].x; H[2]=quad[0].x;
+        H[3]=quad[1].y-quad[0].y+g*quad[1].y; H[4]=quad[3].y-quad[0].y+h*quad[3].y; H[5]=quad[0].y;
+        H[6]=g; H[7]=h; H[8]=1;
+    }
+    cv::Point2f operator()(const cv::Point2f &p)const{
+        double x=H[0]*p.x+H[1]*p.y+H[2];
+        double y=H[3]*p.x+H[4]*p.y+H[5];
+        double z=H[6]*p.x+H[7]*p.y+H[8];
+        return cv::Point2f(x/z,y/z);
+    }
+    double H[9];
+};
+/**runs task(0),...,task(nTasks-1) with executor if it is set, else in the calling thread if nThreads is 1, or with cv::parallel_for_ using at
+ * most nThreads threads
+ */
+inline void runTasks(int nTasks,const std::function<void(int)> &task,int nThreads,const DetectorParams::Executor &executor){
+    if(executor) executor(nTasks,task);
+    else if(nTasks==1 || nThreads<=1){
+        for(int t=0;t<nTasks;t++) task(t);
+    }
+    else{
+        //parallel_for_ runs its stripes on all its threads, so there are only nThreads stripes, each one taking the pending tasks in turn
+        int nStripes=std::min(nTasks,nThreads);
+        std::atomic<int> next{0};
+        struct StripeArgs{const std::function<void(int)> *task;std::atomic<int> *next;int nTasks;} args={&task,&next,nTasks};
+        cv::parallel_for_(cv::Range(0,nStripes),[&args](const cv::Range &range){
+            for(int s=range.start;s<range.end;s++)
+                for(int t=(*args.next)++;t<args.nTasks;t=(*args.next)++) (*args.task)(t);
+        },nStripes);
+    }
+}
+//shrinks or grows markers moving the removed elements into spare, so that their memory is reused in later frames
+inline void resizeMarkers(std::vector<Marker> &markers,size_t n,std::vector<Marker> &spare){
+    while(markers.size()>n){
+        spare.push_back(std::move(markers.back()));
+        markers.pop_back();
+    }
+    while(markers.size()<n){
+        if(spare.empty()) markers.emplace_back();
+        else{
+            markers.push_back(std::move(spare.back()));
+            spare.pop_back();
+        }
+    }
+}
+}
+void MarkerDetector::detect(const cv::Mat &img,std::vector<Marker> &markers){
+    detectImage(img,nullptr,markers);
+}
+void MarkerDetector::detect(const ImageView &img,std::vector<Marker> &markers){
+    detectImage(img,nullptr,markers);
+}
+void MarkerDetector::detect(const cv::Mat &img,const std::vector<cv::Rect> &rois,std::vector<Marker> &markers){
+    detectImage(img,&rois,markers);
+}
+void MarkerDetector::detect(const ImageView &img,const std::vector<cv::Rect> &rois,std::vector<Marker> &markers){
+    detectImage(img,&rois,markers);
+}
+template<typename Image> void MarkerDetector::detectImage(const Image &img,const std::vector<cv::Rect> *rois,std::vector<Marker> &markers){
+    _stats=DetectorStats();
+    int64 start=_params.collectStats?cv::getTickCount():0;
+    auto &&grayImg=toGray(img,rois);
+    if(_params.collectStats) _stats.convertTime=_private::secondsSince(start);
+    detectInternal(grayImg,rois,markers);
+}
+const cv::Mat &MarkerDetector::toGray(const cv::Mat &img,const std::vector<cv::Rect> *rois){
+    if(img.channels()!=3) return img;
+    if(rois==nullptr){
+        cv::cvtColor(img,_grayMat,cv::COLOR_BGR2GRAY);
+        return _grayMat;
+    }
+    //the rest of the buffer keeps the pixels of older frames, which are never read
+    _grayMat.create(img.size(),CV_8UC1);
+    for(const cv::Rect &roi:*rois){
+        cv::Rect region=grayRegion(roi,img.size());
+        if(region.empty()) continue;
+        cv::Mat gray=_grayMat(region);
+        cv::cvtColor(img(region),gray,cv::COLOR_BGR2GRAY);
+    }
+    return _grayMat;
+}
+cv::Mat MarkerDetector::toGray(const ImageView &img,const std::vector<cv::Rect> *rois){
+    size_t stride=img.stride;
+    if(img.format==ImageView::YUYV){
+        cv::Mat yuyv(img.height,img.width,CV_8UC2,const_cast<uchar*>(img.data),stride==0?size_t(img.width)*2:stride);
+        if(rois==nullptr){
+            cv::cvtColor(yuyv,_grayMat,cv::COLOR_YUV2GRAY_YUYV);
+            return _grayMat;
+        }
+        _grayMat.create(img.height,img.width,CV_8UC1);
+        for(const cv::Rect &roi:*rois){
+            cv::Rect region=grayRegion(roi,yuyv.size());
+            //pixels are converted in the pairs that share their chroma
+            int x0=region.x&~1,x1=std::min(img.width,(region.x+region.width+1)&~1);
+            region=cv::Rect(x0,region.y,x1-x0,region.height);
+            if(region.empty()) continue;
+            cv::Mat gray=_grayMat(region);
+            cv::cvtColor(yuyv(region),gray,cv::COLOR_YUV2GRAY_YUYV);
+        }
+        return _grayMat;
+    }
+    //GRAY and the Y plane of NV12 are used in place
+    return cv::Mat(img.height,img.width,CV_8UC1,const_cast<uchar*>(img.data),stride==0?size_t(img.width):stride);
+}
+cv::Rect MarkerDetector::grayRegion(const cv::Rect &roi,cv::Size imgSize)const{
+    //the corners of the markers found in roi are within it, but their refinement may move them as far as its window size, see decodeQuads,
+    //and then read a window and a pixel more around them
+    int margin=2*std::max(2,cvRound(4*std::max(1.f,decimation())))+1;
+    cv::Rect imageRect(0,0,imgSize.width,imgSize.height);
+    if((roi&imageRect).empty()) return cv::Rect();
+    return cv::Rect(roi.x-margin,roi.y-margin,roi.width+2*margin,roi.height+2*margin)&imageRect;
+}
+void MarkerDetector::detectInternal(const cv::Mat &grayImg,const std::vector<cv::Rect> *rois,std::vector<Marker> &markers){
+    findQuads(grayImg,rois,_quads);
+    decodeQuads(grayImg,_quads,markers);
+}
+float MarkerDetector::decimation()const{
+    //markers must be at least 16 pixels wide in the decimated image for their contours to survive the thresholding and the size filter
+    return _params.minMarkerSize>0?std::max(1.f,float(_params.minMarkerSize)/16.f):_params.decimation;
+}
+int MarkerDetector::nThreads()const{
+    return _params.nThreads>0?_params.nThreads:std::max(1,cv::getNumThreads());
+}
+int MarkerDetector::nTasks(size_t nItems)const{
+    int n=nThreads();
+    return n==1 && !_params.executor?1:int(std::max(size_t(1),std::min(nItems,size_t(4*n))));
+}
+void MarkerDetector::findQuads(const cv::Mat &grayImg,const std::vector<cv::Rect> *rois,std::vector<_private::Candidate> &quads){
+    cv::Rect imageRect(0,0,grayImg.cols,grayImg.rows);
+    quads.clear();
+    if(rois==nullptr){
+        if(!imageRect.empty()) findRoiQuads(grayImg,imageRect,decimation(),quads);
+        return;
+    }
+    for(const cv::Rect &rect:*rois){
+        cv::Rect roi=rect&imageRect;
+        if(!roi.empty()) findRoiQuads(grayImg,roi,decimation(),quads);
+    }
+}
+void MarkerDetector::decodeQuads(const cv::Mat &grayImg,const std::vector<_private::Candidate> &quads,std::vector<Marker> &markers){
+    //the quads are split in consecutive chunks whose results are concatenated in order, so the output does not depend on the number of threads
+    int nTasks=this->nTasks(quads.size());
+    if(int(_workspaces.size())<nTasks) _workspaces.resize(nTasks);
+    //a single captured reference fits in the small buffer of std::function, so no allocation is needed to wrap the task
+    struct TaskArgs{MarkerDetector *detector;const cv::Mat *grayImg;const std::vector<_private::Candidate> *quads;int nTasks;} args={this,&grayImg,&quads,nTasks};
+    _private::runTasks(nTasks,[&args](int t){
+        size_t nQuads=args.quads->size();
+        args.detector->decodeCandidates(nQuads*t/args.nTasks,nQuads*(t+1)/args.nTasks,*args.grayImg,*args.quads,args.detector->_workspaces[t]);
+    },nThreads(),_params.executor);
+    _candidates.clear();
+    for(int t=0;t<nTasks;t++){
+        _candidates.insert(_candidates.end(),_workspaces[t].candidates.begin(),_workspaces[t].candidates.end());
+        _stats+=_workspaces[t].stats;
+    }
+    std::sort(_candidates.begin(), _candidates.end(),[](const _private::Candidate &a,const _private::Candidate &b){
+        if( a.id<b.id) return true;
+        else if( a.id==b.id) return a.perimeter>b.perimeter;
         else return false;
     });
-    auto _bb9af5d1915da1fbc132ced081325efcd2e63e4804f96890f42e9739677237a4 = std::unique(vectorMarkers.begin(), vectorMarkers.end(),[](const Marker &_ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb,const Marker &_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d){return _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb.id==_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d.id;});
-    vectorMarkers.resize(std::distance(vectorMarkers.begin(), _bb9af5d1915da1fbc132ced081325efcd2e63e4804f96890f42e9739677237a4));
-    if(vectorMarkers.size()>0){
-        int _a994c48307bd0a3586473a37a87853e7e11429de67117c4e275463feb1904481= 4*float(cvtColorOutputMat.cols)/float(cvtColorOutputMat.cols) +0.5 ;
-        std::vector<cv::Point2f> _1d3cc47e20fd781fdab883c319689b472e4967a37430d8559d4bebe9264ef097;
-        for (const auto &_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a:vectorMarkers)
-            _1d3cc47e20fd781fdab883c319689b472e4967a37430d8559d4bebe9264ef097.insert(_1d3cc47e20fd781fdab883c319689b472e4967a37430d8559d4bebe9264ef097.end(), _62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a.begin(),_62c66a7a5dd70c3146618063c344e531e6d4b59e379808443ce962b3abd63c5a.end());
-        cv::cornerSubPix(cvtColorOutputMat, _1d3cc47e20fd781fdab883c319689b472e4967a37430d8559d4bebe9264ef097, cv::Size(_a994c48307bd0a3586473a37a87853e7e11429de67117c4e275463feb1904481,_a994c48307bd0a3586473a37a87853e7e11429de67117c4e275463feb1904481), cv::Size(-1, -1),cv::TermCriteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005));
-        for (unsigned int _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 = 0; _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 < vectorMarkers.size(); _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7++)
-            for (int _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6 = 0; _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6 < 4; _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6++) vectorMarkers[_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7][_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6] = _1d3cc47e20fd781fdab883c319689b472e4967a37430d8559d4bebe9264ef097[_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 * 4 + _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6];
-    }
-    return vectorMarkers;
-}
-int  MarkerDetector::_9a5e8aa400939eed2bf8f56c0174c17afd0e20f2c77f51286176859429b9f84a(const std::vector<cv::Point2f>& _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb)
-{
-    int _09f5ffef28309853265c4a98d0e56e1be522b6b402d8193594fd05103064fc6a = 0;
-    for (size_t _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 = 0; _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 < _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb.size(); _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7++)
-        _09f5ffef28309853265c4a98d0e56e1be522b6b402d8193594fd05103064fc6a+=cv::norm( _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb[_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7]-_ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb[(_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 + 1) % _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb.size()]);
-    return _09f5ffef28309853265c4a98d0e56e1be522b6b402d8193594fd05103064fc6a;
+    auto last = std::unique(_candidates.begin(), _candidates.end(),[](const _private::Candidate &a,const _private::Candidate &b){return a.id==b.id;});
+    _stats.nDuplicates=std::distance(last,_candidates.end());
+    _candidates.resize(std::distance(_candidates.begin(), last));
+    int64 start=_params.collectStats?cv::getTickCount():0;
+    float decimation=this->decimation();
+    for (auto &candidate:_candidates){
+        //the search window has to cover the error of the corners, which grows with the decimation, but must stay within the border cells
+        float minSide=std::numeric_limits<float>::max();
+        for (int c = 0; c < 4; c++) minSide=std::min(minSide,float(cv::norm(candidate.corners[c]-candidate.corners[(c+1)%4])));
+        int winSize=std::max(2,std::min(cvRound(4*std::max(1.f,decimation)),int(minSide/16)));
+        cv::Mat corners(4,1,CV_32FC2,candidate.corners);
+        cv::cornerSubPix(grayImg, corners, cv::Size(winSize,winSize), cv::Size(-1, -1),cv::TermCriteria( cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.005));
+    }
+    if(_params.collectStats) _stats.refineTime=_private::secondsSince(start);
+    _stats.nMarkers=_candidates.size();
+    _private::resizeMarkers(markers,_candidates.size(),_spareMarkers);
+    for (unsigned int i = 0; i < _candidates.size(); i++){
+        markers[i].assign(_candidates[i].corners,_candidates[i].corners+4);
+        markers[i].id=_candidates[i].id;
+    }
 }
-int MarkerDetector:: _c6c1144f4f3ead4057b05bfa0496c6698e2fdb4dc7074a4fad79e6b49aa65f8d(const cv::Mat &_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814, int &_0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949, const std::vector<uint64_t> &_6ab47d70854a8c690a0c2035be903f3d812cbab06f9e442e9b10ad70b1acd446){
-    auto   _b3797b00b259739867dfce09c958600466f00ab7c478c6564d24819d161b28c0=[](const cv::Mat& _5694d08a2e53ffcae0c3103e5ad6f6076abd960eb1f8a56577040bc1028f702b)
-    {
-        std::bitset<64> _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814;
-        int _02b0d24e699103d27ae7b7e3fd8337921d7ab021af944991881369ae34994f2f = 0;
-        for (int _a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa = _5694d08a2e53ffcae0c3103e5ad6f6076abd960eb1f8a56577040bc1028f702b.rows - 1; _a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa >= 0; _a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa--)
-            for (int _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881 = _5694d08a2e53ffcae0c3103e5ad6f6076abd960eb1f8a56577040bc1028f702b.cols - 1; _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881 >= 0; _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881--)
-                _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814[_02b0d24e699103d27ae7b7e3fd8337921d7ab021af944991881369ae34994f2f++] = _5694d08a2e53ffcae0c3103e5ad6f6076abd960eb1f8a56577040bc1028f702b.at<uchar>(_a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa, _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881);
-        return _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.to_ullong();
-    };
-    auto _299bcf54c044b1b5d49a18da354e16f240b695a1f3a55f1e5217595de59fbb3d=[](const cv::Mat& _582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf)
+void MarkerDetector::findRoiQuads(const cv::Mat &grayImg,const cv::Rect &roi,float decimation,std::vector<_private::Candidate> &quads){
+    const cv::Mat roiImg=grayImg(roi);
+    const cv::Mat *segmentedImg=&roiImg;
+    _contoursScale=cv::Point2f(1,1);
+    _contoursOffset=cv::Point2f(float(roi.x),float(roi.y));
+    if(decimation>1){
+        cv::resize(roiImg,_decimatedMat,cv::Size(std::max(1,cvRound(roi.width/decimation)),std::max(1,cvRound(roi.height/decimation))),0,0,cv::INTER_AREA);
+        _contoursScale=cv::Point2f(float(roi.width)/float(_decimatedMat.cols),float(roi.height)/float(_decimatedMat.rows));
+        segmentedImg=&_decimatedMat;
+    }
+    if(_params.segmentation==DetectorParams::FUSED){
+        _segmenter.segment(*segmentedImg,50,nThreads(),_params.executor,_params.collectStats?&_stats:nullptr);
+        for(size_t i=0;i<_segmenter.quads().size();i++) quads.push_back(makeCandidate(_segmenter.quads()[i].corners,i));
+        return;
+    }
+    int64 start=_params.collectStats?cv::getTickCount():0;
+    cv::adaptiveThreshold(*segmentedImg, _thresholdedMat, 255.,cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV, 7, 7);
+    if(_params.collectStats){
+        _stats.thresholdTime+=_private::secondsSince(start);
+        start=cv::getTickCount();
+    }
+    cv::findContours(_thresholdedMat, _contours, cv::noArray(), cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+    if(_params.collectStats) _stats.contoursTime+=_private::secondsSince(start);
+    _stats.nContours+=_contours.size();
+    int nTasks=this->nTasks(_contours.size());
+    if(int(_workspaces.size())<nTasks) _workspaces.resize(nTasks);
+    struct TaskArgs{MarkerDetector *detector;int nTasks;} args={this,nTasks};
+    _private::runTasks(nTasks,[&args](int t){
+        size_t nContours=args.detector->_contours.size();
+        args.detector->filterContours(nContours*t/args.nTasks,nContours*(t+1)/args.nTasks,args.detector->_workspaces[t]);
+    },nThreads(),_params.executor);
+    for(int t=0;t<nTasks;t++){
+        quads.insert(quads.end(),_workspaces[t].quads.begin(),_workspaces[t].quads.end());
+        _stats+=_workspaces[t].stats;
+    }
+}
+Pipeline::Pipeline(const PipelineParams &params,const DetectorParams &detectorParams,const Callback &callback):_params(params),_callback(callback){
+    _params.nStreams=std::max(1,_params.nStreams);
+    _params.maxFramesInFlight=std::max(1,_params.maxFramesInFlight);
+    if(_params.nWorkers<=0) _params.nWorkers=std::max(1,int(std::thread::hardware_concurrency())/N_STAGES);
+    _params.nWorkers=std::min(_params.nWorkers,_params.nStreams);
+    for(int s=0;s<_params.nStreams;s++){
+        _streams.emplace_back(new Stream(_params.maxFramesInFlight));
+        for(auto &frame:_streams.back()->frames){
+            frame.result.stream=s;
+            _streams.back()->free.push(&frame);
+        }
+    }
+    for(int stage=0;stage<N_STAGES;stage++)
+        for(int w=0;w<_params.nWorkers;w++){
+            _workers[stage].emplace_back(new Worker(detectorParams));
+            if(stage==POSE && !_params.cameraMatrix.empty())
+                _workers[stage].back()->poseEstimator.reset(new PoseEstimator(_params.cameraMatrix,_params.distCoeffs,_params.markerSize));
+        }
+    for(int stage=0;stage<N_STAGES;stage++)
+        for(int w=0;w<_params.nWorkers;w++)
+            _workers[stage][w]->thread=std::thread(&Pipeline::run,this,stage,w);
+}
+Pipeline::~Pipeline(){
+    flush();
+    _stop=true;
+    for(int stage=0;stage<N_STAGES;stage++)
+        for(auto &worker:_workers[stage]){
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->wakeUp.notify_one();
+            }
+            worker->thread.join();
+        }
+}
+bool Pipeline::push(int stream,const cv::Mat &img){
+    Frame *frame=acquire(stream);
+    if(frame==nullptr) return false;
+    if(img.channels()==3) cv::cvtColor(img,frame->gray,cv::COLOR_BGR2GRAY);
+    else if(img.channels()==4) cv::cvtColor(img,frame->gray,cv::COLOR_BGRA2GRAY);
+    else img.copyTo(frame->gray);
+    submit(frame);
+    return true;
+}
+bool Pipeline::push(int stream,const ImageView &img){
+    Frame *frame=acquire(stream);
+    if(frame==nullptr) return false;
+    size_t stride=img.stride;
+    if(img.format==ImageView::YUYV){
+        cv::Mat yuyv(img.height,img.width,CV_8UC2,const_cast<uchar*>(img.data),stride==0?size_t(img.width)*2:stride);
+        cv::cvtColor(yuyv,frame->gray,cv::COLOR_YUV2GRAY_YUYV);
+    }
+    else cv::Mat(img.height,img.width,CV_8UC1,const_cast<uchar*>(img.data),stride==0?size_t(img.width):stride).copyTo(frame->gray);
+    submit(frame);
+    return true;
+}
+void Pipeline::flush(){
+    std::unique_lock<std::mutex> lock(_flushMutex);
+    _flushed.wait(lock,[this](){return _nInFlight.load()==0;});
+}
+Pipeline::Frame *Pipeline::acquire(int stream){
+    if(stream<0 || stream>=int(_streams.size())) return nullptr;
+    Stream &st=*_streams[stream];
+    if(st.nTokens.load()>=st.maxTokens()) return nullptr;
+    Frame *frame;
+    if(st.free.pop(frame)) return frame;
+    if(_params.latencyBudget<=0) return nullptr;
+    //drops the oldest frame not decoded yet if it is over the budget, taking over its buffers
+    for(;;){
+        Frame *oldest=nullptr;
+        int oldestState=FREE;
+        for(auto &f:st.frames){
+            int state=f.state.load();
+            if((state==CANDIDATES || state==DECODE) && (oldest==nullptr || f.index.load(std::memory_order_relaxed)<oldest->index.load(std::memory_order_relaxed))){
+                oldest=&f;
+                oldestState=state;
+            }
+        }
+        if(oldest==nullptr || _private::secondsSince(oldest->pushTick)<=_params.latencyBudget) return nullptr;
+        if(oldest->state.compare_exchange_strong(oldestState,RUNNING)) return oldest;
+        //a worker took it meanwhile, and may have finished another one
+        if(st.free.pop(frame)) return frame;
+    }
+}
+void Pipeline::submit(Frame *frame){
+    Stream &st=*_streams[frame->result.stream];
+    Token token={frame,st.nPushed++,cv::getTickCount(),false};
+    frame->pushTick=token.pushTick;
+    frame->index.store(token.index,std::memory_order_relaxed);
+    frame->result.frame=token.index;
+    frame->result.dropped=false;
+    st.nTokens++;
+    _nInFlight++;
+    frame->state.store(CANDIDATES);
+    enqueue(CANDIDATES,token);
+}
+void Pipeline::enqueue(int stage,const Token &token){
+    int stream=token.frame->result.stream;
+    //never fails: a queue can hold all the tokens of its stream
+    _streams[stream]->queues[stage].push(token);
+    //pairs with the fence of run, so that either the worker sees the frame before sleeping or we see it sleeping and wake it up
+    Worker &worker=*_workers[stage][stream%_params.nWorkers];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(worker.sleeping.load(std::memory_order_relaxed)){
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.wakeUp.notify_one();
+    }
+}
+void Pipeline::run(int stage,int w){
+    Worker &worker=*_workers[stage][w];
+    for(;;){
+        //one frame of each stream per round, so that a busy stream does not starve the others
+        bool busy=false;
+        for(size_t s=w;s<_streams.size();s+=_params.nWorkers){
+            _private::SpscQueue<Token> &queue=_streams[s]->queues[stage];
+            Token token;
+            //evicted frames cost nothing, so they are passed on until there is a frame to process
+            while(queue.pop(token)){
+                busy=true;
+                if(!token.evicted){
+                    //the buffers of the frame may have been taken over by a newer one, even one waiting for this same stage
+                    Frame &frame=*token.frame;
+                    int waiting=stage;
+                    if(!frame.state.compare_exchange_strong(waiting,RUNNING)) token.evicted=true;
+                    else if(frame.index.load(std::memory_order_relaxed)!=token.index){
+                        frame.state.store(stage);
+                        token.evicted=true;
+                    }
+                    //drops the oldest frames only, and only if there is a newer one to process instead. Once decoded, a frame is always delivered,
+                    //as estimating its poses is cheap and dropping it would not spare any detection
+                    else if(_params.latencyBudget>0 && stage!=POSE && !frame.result.dropped && !queue.empty() && _private::secondsSince(token.pushTick)>_params.latencyBudget)
+                        frame.result.dropped=true;
+                }
+                process(stage,worker,token);
+                if(!token.evicted) break;
+            }
+        }
+        if(busy) continue;
+        if(_stop) return;
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.sleeping.store(true,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool idle=true;
+        for(size_t s=w;s<_streams.size() && idle;s+=_params.nWorkers) idle=_streams[s]->queues[stage].empty();
+        if(idle && !_stop) worker.wakeUp.wait_for(lock,std::chrono::milliseconds(100));
+        worker.sleeping.store(false,std::memory_order_relaxed);
+    }
+}
+void Pipeline::process(int stage,Worker &worker,const Token &token){
+    int stream=token.frame->result.stream;
+    if(token.evicted){
+        if(stage!=POSE){
+            enqueue(stage+1,token);
+            return;
+        }
+        FrameResult &result=worker.evictedResult;
+        result.stream=stream;
+        result.frame=token.index;
+        result.dropped=true;
+        result.latency=_private::secondsSince(token.pushTick);
+        _callback(result);
+        delivered(stream);
+        return;
+    }
+    Frame &frame=*token.frame;
+    FrameResult &result=frame.result;
+    switch(stage){
+    case CANDIDATES:
+        worker.detector._stats=DetectorStats();
+        if(!result.dropped) worker.detector.findQuads(frame.gray,nullptr,frame.quads);
+        frame.state.store(DECODE);
+        enqueue(DECODE,token);
+        break;
+    case DECODE:
+        worker.detector._stats=DetectorStats();
+        if(!result.dropped) worker.detector.decodeQuads(frame.gray,frame.quads,result.markers);
+        frame.state.store(POSE);
+        enqueue(POSE,token);
+        break;
+    default:
+        if(result.dropped) result.markers.clear();
+        if(!result.dropped && worker.poseEstimator) worker.poseEstimator->estimate(result.markers,result.poses);
+        else result.poses.clear();
+        result.latency=_private::secondsSince(token.pushTick);
+        _callback(result);
+        frame.state.store(FREE);
+        _streams[stream]->free.push(&frame);
+        delivered(stream);
+        break;
+    }
+}
+void Pipeline::delivered(int stream){
+    _streams[stream]->nTokens--;
+    //notifying under the lock, flush cannot miss it between checking the count and waiting
+    if(--_nInFlight==0){
+        std::lock_guard<std::mutex> lock(_flushMutex);
+        _flushed.notify_all();
+    }
+}
+void MarkerTracker::track(const cv::Mat &img,std::vector<Marker> &markers){
+    trackInternal(img,img.size(),markers);
+}
+void MarkerTracker::track(const ImageView &img,std::vector<Marker> &markers){
+    trackInternal(img,cv::Size(img.width,img.height),markers);
+}
+template<typename Image> void MarkerTracker::trackInternal(const Image &img,cv::Size imgSize,std::vector<Marker> &markers){
+    if(imgSize!=_imgSize){
+        _imgSize=imgSize;
+        reset();
+    }
+    bool fullDetection=_tracks.empty() || _params.fullDetectionInterval<=1 || _frameCount%_params.fullDetectionInterval==0;
+    _frameCount++;
+    if(!fullDetection){
+        //constant velocity prediction of each marker, searched within its enlarged bounding box
+        _rois.clear();
+        for(const auto &track:_tracks){
+            cv::Point2f tl(std::numeric_limits<float>::max(),std::numeric_limits<float>::max()),br(-tl.x,-tl.y);
+            float maxSide=0;
+            for(int c=0;c<4;c++){
+                cv::Point2f p=track.corners[c]+track.velocity[c];
+                tl=cv::Point2f(std::min(tl.x,p.x),std::min(tl.y,p.y));
+                br=cv::Point2f(std::max(br.x,p.x),std::max(br.y,p.y));
+                maxSide=std::max(maxSide,float(cv::norm(track.corners[c]-track.corners[(c+1)%4])));
+            }
+            float margin=_params.roiMargin*maxSide;
+            cv::Rect roi(cv::Point(cvFloor(tl.x-margin),cvFloor(tl.y-margin)),cv::Point(cvCeil(br.x+margin)+1,cvCeil(br.y+margin)+1));
+            roi&=cv::Rect(0,0,imgSize.width,imgSize.height);
+            if(!roi.empty()) _rois.push_back(roi);
+        }
+        //overlapping regions are merged so that no area is processed twice
+        for(bool merged=true;merged;){
+            merged=false;
+            for(size_t i=0;i<_rois.size() && !merged;i++)
+                for(size_t j=i+1;j<_rois.size() && !merged;j++)
+                    if(!(_rois[i]&_rois[j]).empty()){
+                        _rois[i]|=_rois[j];
+                        _rois.erase(_rois.begin()+j);
+                        merged=true;
+                    }
+        }
+        _detector.detect(img,_rois,markers);
+        //a marker moved beyond its predicted region or left the scene. Look in the whole image before dropping it
+        for(const auto &track:_tracks)
+            if(std::find_if(markers.begin(),markers.end(),[&track](const Marker &m){return m.id==track.id;})==markers.end()){
+                fullDetection=true;
+                break;
+            }
+    }
+    if(fullDetection) _detector.detect(img,markers);
+    update(markers);
+}
+void MarkerTracker::update(const std::vector<Marker> &markers){
+    std::swap(_tracks,_previousTracks);
+    _tracks.clear();
+    //markers and tracks are both sorted by id
+    size_t t=0;
+    for(const auto &marker:markers){
+        while(t<_previousTracks.size() && _previousTracks[t].id<marker.id) t++;
+        bool tracked=t<_previousTracks.size() && _previousTracks[t].id==marker.id;
+        Track track;
+        track.id=marker.id;
+        for(int c=0;c<4;c++){
+            track.corners[c]=marker[c];
+            track.velocity[c]=tracked?marker[c]-_previousTracks[t].corners[c]:cv::Point2f(0,0);
+        }
+        _tracks.push_back(track);
+    }
+}
+_private::Candidate MarkerDetector::makeCandidate(const cv::Point quad[4],size_t index)const{
+    _private::Candidate candidate;
+    for (int c = 0; c < 4; c++)
+        candidate.corners[c]=cv::Point2f( _contoursOffset.x+(quad[c].x+0.5f)*_contoursScale.x-0.5f,_contoursOffset.y+(quad[c].y+0.5f)*_contoursScale.y-0.5f);
+    sortCorners(candidate.corners);
+    candidate.index=index;
+    candidate.jitter=0.75f*std::max(_contoursScale.x,_contoursScale.y);
+    return candidate;
+}
+void MarkerDetector::filterContours(size_t begin,size_t end,_private::Workspace &workspace)const{
+    std::vector<cv::Point> &maybeCorners=workspace.maybeCorners;
+    DetectorStats &stats=workspace.stats;
+    workspace.quads.clear();
+    stats=DetectorStats();
+    int64 start=_params.collectStats?cv::getTickCount():0;
+    for (size_t i = begin; i < end; i++)
     {
-        cv::Mat someMat(_582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf.size(),_582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf.type());
-        for (int _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 = 0; _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7 < _582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf.rows; _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7++)
-            for (int _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7 = 0; _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7 < _582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf.cols; _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7++)
-                someMat.at<uchar>(_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7, _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7) = _582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf.at<uchar>(_582967534d0f909d196b97f9e6921342777aea87b46fa52df165389db1fb8ccf.cols - _189f40034be7a199f1fa9891668ee3ab6049f82d38c68be70f596eab2e1857b7 - 1, _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7);
-        return someMat;
-    };
-    for(int _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881=0;_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881<_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.cols;_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881++){
-        if( _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.at<uchar>(0,_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881)!=0)return -1;
-        if( _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.at<uchar>(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.rows-1,_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881)!=0)return -1;
-        if( _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.at<uchar>(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881,0)!=0)return -1;
-        if( _e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.at<uchar>(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881,_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.cols-1)!=0)return -1;
-    }
-    cv::Mat _3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae(_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.cols-2,_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.rows-2,CV_8UC1);
-    for(int _454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1=0;_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1<_3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae.rows;_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1++)
-        for(int _2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6=0;_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6<_3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae.cols;_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6++)
-            _3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae.at<uchar>(_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1,_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6)=_e5e59d10f196504b6e08ac7785f84430a61e1558fd6246075a9566edaab2e814.at<uchar>(_454349e422f05297191ead13e21d3db520e5abef52055e4964b82fb213f593a1+1,_2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6+1);
-    _0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949 = 0;
-    do
+        if (50 > int(_contours[i].size())  ){
+            stats.nSmall++;
+            continue;
+        }
+        cv::approxPolyDP(_contours[i], maybeCorners, double(_contours[i].size()) * 0.05, true);
+        if (maybeCorners.size() != 4 || !cv::isContourConvex(maybeCorners)){
+            stats.nNotQuads++;
+            continue;
+        }
+        workspace.quads.push_back(makeCandidate(maybeCorners.data(),i));
+    }
+    if(_params.collectStats) stats.polygonTime=_private::secondsSince(start);
+}
+void MarkerDetector::decodeCandidates(size_t begin,size_t end,const cv::Mat &grayImg,const std::vector<_private::Candidate> &quads,_private::Workspace &workspace)const{
+    DetectorStats &stats=workspace.stats;
+    workspace.candidates.clear();
+    stats=DetectorStats();
+    int64 start=_params.collectStats?cv::getTickCount():0;
+    for (size_t i = begin; i < end; i++)
     {
-        auto _a56145270ce6b3bebd1dd012b73948677dd618d496488bc608a3cb43ce3547dd= _b3797b00b259739867dfce09c958600466f00ab7c478c6564d24819d161b28c0(_3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae);
-        for(size_t _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7=0;_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7<_6ab47d70854a8c690a0c2035be903f3d812cbab06f9e442e9b10ad70b1acd446.size();_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7++)
-            if( _6ab47d70854a8c690a0c2035be903f3d812cbab06f9e442e9b10ad70b1acd446[_de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7]==_a56145270ce6b3bebd1dd012b73948677dd618d496488bc608a3cb43ce3547dd)
-                return _de7d1b721a1e0632b7cf04edf5032c8ecffa9f9a08492152b926f1a5a7e765d7;
-        _3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae = _299bcf54c044b1b5d49a18da354e16f240b695a1f3a55f1e5217595de59fbb3d(_3d2e5cb9cb8bcf4ad6cee2400e10069c7ec5a06a2e828f11ae8b62b16549e9ae);
-        _0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949++;
-    } while (_0178aae7493190d80ba0e49c5707b92a9c67402d4fb12a0650073236d196e949 < 4);
-    return -1;
-}
-float MarkerDetector::_24b3b2c1ce549055e1ea87fa3e826a5ae86ed517e4756d42f981aefeb14f6b7c(const cv::Mat &_a0928816cc7978aa29fd5c1e99af8f9ec59ac527b07592389ad0606372d79f5f,const cv::Point2f &_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940){
-     float _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881=int(_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x);
-    float _a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa=int(_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.y);
-    if (_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881<0 || _2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881>=_a0928816cc7978aa29fd5c1e99af8f9ec59ac527b07592389ad0606372d79f5f.cols-1 || _a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa<0 || _a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa>=_a0928816cc7978aa29fd5c1e99af8f9ec59ac527b07592389ad0606372d79f5f.rows-1)   return 0;
-    const uchar* _82e8df007d978f9b982ada73382b95119f38d110c46981cb2c589458b03bb6b3=_a0928816cc7978aa29fd5c1e99af8f9ec59ac527b07592389ad0606372d79f5f.ptr<uchar>(_a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa);
-    const uchar* _5016153570b06a9fae1c31a2968f049169411ef0c5cebc088e3333654e04999f=_a0928816cc7978aa29fd5c1e99af8f9ec59ac527b07592389ad0606372d79f5f.ptr<uchar>(_a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa+1);
-    float _e66016570cfafca08140913fe701f02954a11fde7f8660500a617597fd17e09d=float(_82e8df007d978f9b982ada73382b95119f38d110c46981cb2c589458b03bb6b3[int(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881)]);
-    float _7817bb812e82168bd48fe1ea6783078d42be37e8db9bdaafdac5c45804aca64f=float(_82e8df007d978f9b982ada73382b95119f38d110c46981cb2c589458b03bb6b3[int(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881+1)]);
-    float _29d9489564c875d731108c8fbd8dfa3e698ca20be4c00878dda716de8c993b97=float(_5016153570b06a9fae1c31a2968f049169411ef0c5cebc088e3333654e04999f[int(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881)]);
-    float _885036a0da3dff3c3e05bc79bf49382b12bc5098514ed57ce0875aba1aa2c40d=float(_5016153570b06a9fae1c31a2968f049169411ef0c5cebc088e3333654e04999f[int(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881+1)]);
-    float _ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb= float(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881+1.f-_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x) * _e66016570cfafca08140913fe701f02954a11fde7f8660500a617597fd17e09d  + (_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x-_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881)*_7817bb812e82168bd48fe1ea6783078d42be37e8db9bdaafdac5c45804aca64f;
-    float _3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d= float(_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881+1.f-_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x) * _29d9489564c875d731108c8fbd8dfa3e698ca20be4c00878dda716de8c993b97  + (_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.x-_2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881)*_885036a0da3dff3c3e05bc79bf49382b12bc5098514ed57ce0875aba1aa2c40d;
-    return   (_a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa+1-_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.y)*_ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb   + (_148de9c5a7a44d19e56cd9ae1a554bf67847afb0c58f6e12fa29ac7ddfca9940.y-_a1fce4363854ff888cff4b8e7875d600c2682390412a8cf79b37d0b11148b0fa)*_3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d;
- }
-Marker  MarkerDetector::_32674b0393ce09cbb2335aaefa8ef8579e14890d49ea4a6034287e01ed3da198( const  Marker &_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e){
-    Marker _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a=_ed5b8120601641c516d02ed9dc643a59648524248d5e2af877da39ea253c723e;
-    double _cb708a96aad193fca2f4400f0528a30b6d057a242a410b73850f6a2e8bf3b412 = _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[1].x - _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[0].x;
-    double _74230a614c528876f9f7d95ba9a8a23aab1f30e158dbec0c6b9037c301fe0e7c = _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[1].y - _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[0].y;
-    double _0e6fa136e6797dce96cbb0516f2f6a646c0112be6d6c1db87ffca42cfab43f62 = _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[2].x - _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[0].x;
-    double _4553283b6e27d97c246d95a517f6436deba9f41927296fb63f08ce5c0bc8beeb = _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[2].y - _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[0].y;
-    double _65c74c15a686187bb6bbf9958f494fc6b80068034a659a9ad44991b08c58f2d2 = (_cb708a96aad193fca2f4400f0528a30b6d057a242a410b73850f6a2e8bf3b412 * _4553283b6e27d97c246d95a517f6436deba9f41927296fb63f08ce5c0bc8beeb) - (_74230a614c528876f9f7d95ba9a8a23aab1f30e158dbec0c6b9037c301fe0e7c * _0e6fa136e6797dce96cbb0516f2f6a646c0112be6d6c1db87ffca42cfab43f62);
-    if (_65c74c15a686187bb6bbf9958f494fc6b80068034a659a9ad44991b08c58f2d2 < 0.0)  std::swap(_d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[1], _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a[3]);
-    return _d458eb35e592de3c9f05278730a182203d8494fe15489d01d76a24a361dafc7a;
-}
-std::pair<cv::Mat,cv::Mat> Marker::estimatePose(cv::Mat cameraMatrix,cv::Mat distCoeffs,double markerSize) const{
-    std::vector<cv::Point3d> markerCorners={ {-markerSize/2.f,markerSize/2.f,0.f},{markerSize/2.f,markerSize/2.f,0.f},{markerSize/2.f,-markerSize/2.f,0.f},{-markerSize/2.f,-markerSize/2.f,0.f}};
+        _private::Candidate candidate=quads[i];
+        cv::RNG cvRng(0xffffffffULL+candidate.index);
+        double jitter=candidate.jitter;
+        for(unsigned int attempt=0;attempt<_params.maxAttemptsPerCandidate && candidate.id==-1;attempt++){
+            cv::Point2f corners[4];
+            std::copy(candidate.corners,candidate.corners+4,corners);
+            if( attempt!=0) for(int c=0;c<4;c++) {corners[c].x+=cvRng.gaussian(jitter);corners[c].y+=cvRng.gaussian(jitter);}
+            int nRotations=0;
+            stats.nDecodeAttempts++;
+            candidate.id=getMarkerId(sampleBits(grayImg,corners,_params.cellThreshold),nRotations,_params.maxCorrectionBits);
+            if(candidate.id==-1) continue;
+            std::rotate(candidate.corners,candidate.corners + 4 - nRotations,candidate.corners+4);
+        }
+        if(candidate.id!=-1){
+            candidate.perimeter=perimeter(candidate.corners);
+            workspace.candidates.push_back(candidate);
+        }
+        else stats.nUndecoded++;
+    }
+    if(_params.collectStats) stats.decodeTime=_private::secondsSince(start);
+}
+const _private::DictionaryIndex &MarkerDetector::arucoMip36h12(){
+    static const uint64_t codes[]={0xd2b63a09dUL,0x6001134e5UL,0x1206fbe72UL,0xff8ad6cb4UL,0x85da9bc49UL,0xb461afe9cUL,0x6db51fe13UL,0x5248c541fUL,0x8f34503UL,0x8ea462eceUL,0xeac2be76dUL,0x1af615c44UL,0xb48a49f27UL,0x2e4e1283bUL,0x78b1f2fa8UL,0x27d34f57eUL,0x89222fff1UL,0x4c1669406UL,0xbf49b3511UL,0xdc191cd5dUL,0x11d7c3f85UL,0x16a130e35UL,0xe29f27effUL,0x428d8ae0cUL,0x90d548477UL,0x2319cbc93UL,0xc3b0c3dfcUL,0x424bccc9UL,0x2a081d630UL,0x762743d96UL,0xd0645bf19UL,0xf38d7fd60UL,0xc6cbf9a10UL,0x3c1be7c65UL,0x276f75e63UL,0x4490a3f63UL,0xda60acd52UL,0x3cc68df59UL,0xab46f9daeUL,0x88d533d78UL,0xb6d62ec21UL,0xb3c02b646UL,0x22e56d408UL,0xac5f5770aUL,0xaaa993f66UL,0x4caa07c8dUL,0x5c9b4f7b0UL,0xaa9ef0e05UL,0x705c5750UL,0xac81f545eUL,0x735b91e74UL,0x8cc35cee4UL,0xe44694d04UL,0xb5e121de0UL,0x261017d0fUL,0xf1d439eb5UL,0xa1a33ac96UL,0x174c62c02UL,0x1ee27f716UL,0x8b1c5ece9UL,0x6a05b0c6aUL,0xd0568dfcUL,0x192d25e5fUL,0x1adbeccc8UL,0xcfec87f00UL,0xd0b9dde7aUL,0x88dcef81eUL,0x445681cb9UL,0xdbb2ffc83UL,0xa48d96df1UL,0xb72cc2e7dUL,0xc295b53fUL,0xf49832704UL,0x9968edc29UL,0x9e4e1af85UL,0x8683e2d1bUL,0x810b45c04UL,0x6ac44bfe2UL,0x645346615UL,0x3990bd598UL,0x1c9ed0f6aUL,0xc26729d65UL,0x83993f795UL,0x3ac05ac5dUL,0x357adff3bUL,0xd5c05565UL,0x2f547ef44UL,0x86c115041UL,0x640fd9e5fUL,0xce08bbcf7UL,0x109bb343eUL,0xc21435c92UL,0x35b4dfce4UL,0x459752cf2UL,0xec915b82cUL,0x51881eed0UL,0x2dda7dc97UL,0x2e0142144UL,0x42e890f99UL,0x9a8856527UL,0x8e80d9d80UL,0x891cbcf34UL,0x25dd82410UL,0x239551d34UL,0x8fe8f0c70UL,0x94106a970UL,0x82609b40cUL,0xfc9caf36UL,0x688181d11UL,0x718613c08UL,0xf1ab7629UL,0xa357bfc18UL,0x4c03b7a46UL,0x204dedce6UL,0xad6300d37UL,0x84cc4cd09UL,0x42160e5c4UL,0x87d2adfa8UL,0x7850e7749UL,0x4e750fc7cUL,0xbf2e5dfdaUL,0xd88324da5UL,0x234b52f80UL,0x378204514UL,0xabdf2ad53UL,0x365e78ef9UL,0x49caa6ca2UL,0x3c39ddf3UL,0xc68c5385dUL,0x5bfcbbf67UL,0x623241e21UL,0xabc90d5ccUL,0x388c6fe85UL,0xda0e2d62dUL,0x10855dfe9UL,0x4d46efd6bUL,0x76ea12d61UL,0x9db377d3dUL,0xeed0efa71UL,0xe6ec3ae2fUL,0x441faee83UL,0xba19c8ff5UL,0x313035eabUL,0x6ce8f7625UL,0x880dab58dUL,0x8d3409e0dUL,0x2be92ee21UL,0xd60302c6cUL,0x469ffc724UL,0x87eebeed3UL,0x42587ef7aUL,0x7a8cc4e52UL,0x76a437650UL,0x999e41ef4UL,0x7d0969e42UL,0xc02baf46bUL,0x9259f3e47UL,0x2116a1dc0UL,0x9f2de4d84UL,0xeffac29UL,0x7b371ff8cUL,0x668339da9UL,0xd010aee3fUL,0x1cd00b4c0UL,0x95070fc3bUL,0xf84c9a770UL,0x38f863d76UL,0x3646ff045UL,0xce1b96412UL,0x7a5d45da8UL,0x14e00ef6cUL,0x5e95abfd8UL,0xb2e9cb729UL,0x36c47dd7UL,0xb8ee97c6bUL,0xe9e8f657UL,0xd4ad2ef1aUL,0x8811c7f32UL,0x47bde7c31UL,0x3adadfb64UL,0x6e5b28574UL,0x33e67cd91UL,0x2ab9fdd2dUL,0x8afa67f2bUL,0xe6a28fc5eUL,0x72049cdbdUL,0xae65dac12UL,0x1251a4526UL,0x1089ab841UL,0xe2f096ee0UL,0xb0caee573UL,0xfd6677e86UL,0x444b3f518UL,0xbe8b3a56aUL,0x680a75cfcUL,0xac02baea8UL,0x97d815e1cUL,0x1d4386e08UL,0x1a14f5b0eUL,0xe658a8d81UL,0xa3868efa7UL,0x3668a9673UL,0xe8fc53d85UL,0x2e2b7edd5UL,0x8b2470f13UL,0xf69795f32UL,0x4589ffc8eUL,0x2e2080c9cUL,0x64265f7dUL,0x3d714dd10UL,0x1692c6ef1UL,0x3e67f2f49UL,0x5041dad63UL,0x1a1503415UL,0x64c18c742UL,0xa72eec35UL,0x1f0f9dc60UL,0xa9559bc67UL,0xf32911d0dUL,0x21c0d4ffcUL,0xe01cef5b0UL,0x4e23a3520UL,0xaa4f04e49UL,0xe1c4fcc43UL,0x208e8f6e8UL,0x8486774a5UL,0x9e98c7558UL,0x2c59fb7dcUL,0x9446a4613UL,0x8292dcc2eUL,0x4d61631UL,0xd05527809UL,0xa0163852dUL,0x8f657f639UL,0xcca6c3e37UL,0xcb136bc7aUL,0xfc5a83e53UL,0x9aa44fc30UL,0xbdec1bd3cUL,0xe020b9f7cUL,0x4b8f35fb0UL,0xb8165f637UL,0x33dc88d69UL,0x10a2f7e4dUL,0xc8cb5ff53UL,0xde259ff6bUL,0x46d070dd4UL,0x32d3b9741UL,0x7075f1c04UL,0x4d58dbea0UL};
+    static const _private::DictionaryIndex index(codes,sizeof(codes)/sizeof(codes[0]),36);
+    return index;
+}
+int  MarkerDetector::perimeter(const cv::Point2f corners[4])
+{
+    int sum = 0;
+    for (int i = 0; i < 4; i++)
+        sum+=cv::norm( corners[i]-corners[(i + 1) % 4]);
+    return sum;
+}
+cv::Mat MarkerDetector::markerImage(int id,int cellSize){
+    const _private::DictionaryIndex &dictionary=arucoMip36h12();
+    if(id<0 || id>=dictionary.size() || cellSize<1) return cv::Mat();
+    cv::Mat img(8*cellSize,8*cellSize,CV_8UC1,cv::Scalar(0));
+    uint64_t code=dictionary.code(id);
+    for(int r=0;r<6;r++)
+        for(int c=0;c<6;c++)
+            if((code>>(35-(r*6+c)))&1) img(cv::Rect((c+1)*cellSize,(r+1)*cellSize,cellSize,cellSize)).setTo(cv::Scalar(255));
+    return img;
+}
+int MarkerDetector::getMarkerId(uint64_t bits, int &nRotations, int maxCorrectionBits){
+    //the border cells must be black
+    if(bits&0xFF818181818181FFULL) return -1;
+    //packs the inner bits, the last cell being the least significant bit
+    uint64_t code=0;
+    for(int r=1;r<7;r++)
+        code=(code<<6) | ((bits>>(57-8*r))&0x3f);
+    int distance;
+    return arucoMip36h12().find(code,maxCorrectionBits,nRotations,distance);
+}
+/**samples the centers of the 8x8 cells of the quad and returns them binarized, cell (r,c) being bit 63-(r*8+c).
+ * The cells are projected all at once in a plain float loop that the compiler vectorizes (SSE/AVX/NEON)
+ */
+uint64_t MarkerDetector::sampleBits(const cv::Mat &grayImg,const cv::Point2f corners[4],DetectorParams::CellThreshold cellThreshold){
+    static const struct CellCenters{
+        CellCenters(){
+            for(int i=0;i<64;i++){
+                u[i]=(float(i%8)+0.5f)/8.f;
+                v[i]=(float(i/8)+0.5f)/8.f;
+            }
+        }
+        float u[64],v[64];
+    } cells;
+    _private::Homography homography(corners);
+    float H[9];
+    for(int i=0;i<9;i++) H[i]=float(homography.H[i]);
+    //projection of the cell centers, split in integer pixel and fractional offset
+    int xs[64],ys[64];
+    float fxs[64],fys[64];
+    for(int i=0;i<64;i++){
+        float z=1.f/(H[6]*cells.u[i]+H[7]*cells.v[i]+H[8]);
+        float x=(H[0]*cells.u[i]+H[1]*cells.v[i]+H[2])*z;
+        float y=(H[3]*cells.u[i]+H[4]*cells.v[i]+H[5])*z;
+        xs[i]=int(x);
+        ys[i]=int(y);
+        fxs[i]=x-float(xs[i]);
+        fys[i]=y-float(ys[i]);
+    }
+    //cells out of the image are black. Negative coordinates wrap around to large unsigned values
+    unsigned int maxX=unsigned(grayImg.cols-1),maxY=unsigned(grayImg.rows-1);
+    size_t offsets[64];
+    float inside[64];
+    for(int i=0;i<64;i++){
+        bool in=unsigned(xs[i])<maxX && unsigned(ys[i])<maxY;
+        offsets[i]=in?size_t(ys[i])*grayImg.step+size_t(xs[i]):0;
+        inside[i]=in?1.f:0.f;
+    }
+    //gathers the 2x2 neighbourhoods without branches and interpolates them
+    const uchar *data=grayImg.ptr<uchar>(0);
+    size_t step=grayImg.step;
+    float p00[64],p01[64],p10[64],p11[64];
+    for(int i=0;i<64;i++){
+        const uchar *p=data+offsets[i];
+        p00[i]=p[0];
+        p01[i]=p[1];
+        p10[i]=p[step];
+        p11[i]=p[step+1];
+    }
+    uchar samples[64];
+    int sum=0;
+    for(int i=0;i<64;i++){
+        float top=p00[i]+fxs[i]*(p01[i]-p00[i]);
+        float bottom=p10[i]+fxs[i]*(p11[i]-p10[i]);
+        samples[i]=uchar(0.5f+inside[i]*(top+fys[i]*(bottom-top)));
+        sum+=samples[i];
+    }
+    //cells brighter than threshold are white
+    int threshold=sum/64;
+    if(cellThreshold==DetectorParams::OTSU){
+        uchar sorted[64];
+        std::copy(samples,samples+64,sorted);
+        std::sort(sorted,sorted+64);
+        double bestVariance=-1,sum0=0;
+        for(int k=1;k<64;k++){
+            sum0+=sorted[k-1];
+            if(sorted[k-1]==sorted[k]) continue;
+            //between class variance of splitting the sorted samples in [0,k) and [k,64), up to a constant factor
+            double d=sum0*64-double(sum)*k;
+            double variance=d*d/(double(k)*double(64-k));
+            if(variance>bestVariance){
+                bestVariance=variance;
+                threshold=sorted[k-1];
+            }
+        }
+    }
+    uint64_t bits=0;
+    for(int i=0;i<64;i++)
+        bits=(bits<<1) | uint64_t(samples[i]>threshold);
+    return bits;
+}
+void  MarkerDetector::sortCorners( cv::Point2f corners[4]){
+    double dx1 = corners[1].x - corners[0].x;
+    double dy1 = corners[1].y - corners[0].y;
+    double dx2 = corners[2].x - corners[0].x;
+    double dy2 = corners[2].y - corners[0].y;
+    double crossProduct = (dx1 * dy2) - (dy1 * dx2);
+    if (crossProduct < 0.0)  std::swap(corners[1], corners[3]);
+}
+namespace _private {
+inline int popCount(uint64_t x){
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x=x-((x>>1)&0x5555555555555555ULL);
+    x=(x&0x3333333333333333ULL)+((x>>2)&0x3333333333333333ULL);
+    x=(x+(x>>4))&0x0f0f0f0f0f0f0f0fULL;
+    return int((x*0x0101010101010101ULL)>>56);
+#endif
+}
+DictionaryIndex::DictionaryIndex(const uint64_t *codes,int nCodes,int nBits):_nCodes(nCodes),_rotatedCodes(4*nCodes){
+    size_t tableSize=16;
+    while(tableSize<8*size_t(nCodes)) tableSize*=2;
+    _table.assign(tableSize,0);
+    for(int r=0;r<4;r++){
+        for(int id=0;id<nCodes;id++){
+            uint64_t code=codes[id];
+            for(int k=0;k<(4-r)%4;k++) code=rotate(code,nBits);
+            _rotatedCodes[r*nCodes+id]=code;
+            //keeps the first entry if two rotations collide, as a sequential search would
+            uint16_t &s=slot(code);
+            if(s==0) s=uint16_t(1+r*nCodes+id);
+        }
+    }
+}
+uint64_t DictionaryIndex::rotate(uint64_t code,int nBits){
+    //90 degrees clockwise: cell (r,c) of the rotated grid is cell (n-1-c,r) of the original, cell (0,0) being the most significant bit
+    int n=int(std::sqrt(double(nBits))+0.5);
+    uint64_t rotated=0;
+    for(int r=0;r<n;r++)
+        for(int c=0;c<n;c++)
+            rotated=(rotated<<1) | ((code>>(nBits-1-((n-1-c)*n+r)))&1);
+    return rotated;
+}
+uint16_t &DictionaryIndex::slot(uint64_t code){
+    size_t mask=_table.size()-1;
+    size_t i=size_t((code*0x9E3779B97F4A7C15ULL)>>32)&mask;
+    while(_table[i]!=0 && _rotatedCodes[_table[i]-1]!=code) i=(i+1)&mask;
+    return _table[i];
+}
+int DictionaryIndex::find(uint64_t code,int maxCorrectionBits,int &nRotations,int &distance)const{
+    size_t mask=_table.size()-1;
+    for(size_t i=size_t((code*0x9E3779B97F4A7C15ULL)>>32)&mask;_table[i]!=0;i=(i+1)&mask){
+        int entry=_table[i]-1;
+        if(_rotatedCodes[entry]==code){
+            nRotations=entry/_nCodes;
+            distance=0;
+            return entry%_nCodes;
+        }
+    }
+    if(maxCorrectionBits<=0) return -1;
+    int best=-1;
+    distance=maxCorrectionBits+1;
+    for(size_t i=0;i<_rotatedCodes.size();i++){
+        int d=popCount(_rotatedCodes[i]^code);
+        if(d<distance){
+            distance=d;
+            best=int(i);
+        }
+    }
+    if(best==-1) return -1;
+    nRotations=best/_nCodes;
+    return best%_nCodes;
+}
+void QuadSegmenter::segment(const cv::Mat &grayImg,int minContourSize,int nThreads,const DetectorParams::Executor &executor,DetectorStats *stats){
+    _quads.clear();
+    if(grayImg.empty()) return;
+    int64 start=stats?cv::getTickCount():0;
+    _binary.create(grayImg.rows+2,grayImg.cols+2,CV_8UC1);
+    std::fill(_binary.ptr<uchar>(0),_binary.ptr<uchar>(0)+_binary.cols,uchar(0));
+    std::fill(_binary.ptr<uchar>(_binary.rows-1),_binary.ptr<uchar>(_binary.rows-1)+_binary.cols,uchar(0));
+    //each band of rows is thresholded by its own task, its runs being concatenated in order afterwards
+    int nBands=std::max(1,std::min(nThreads,grayImg.rows));
+    if(int(_tasks.size())<nBands) _tasks.resize(nBands);
+    struct BandArgs{QuadSegmenter *segmenter;const cv::Mat *grayImg;int nBands;} bandArgs={this,&grayImg,nBands};
+    runTasks(nBands,[&bandArgs](int t){
+        int rows=bandArgs.grayImg->rows;
+        bandArgs.segmenter->thresholdBand(*bandArgs.grayImg,rows*t/bandArgs.nBands,rows*(t+1)/bandArgs.nBands,bandArgs.segmenter->_tasks[t]);
+    },nThreads,executor);
+    if(stats){
+        stats->thresholdTime+=secondsSince(start);
+        start=cv::getTickCount();
+    }
+    _runs.clear();
+    for(int t=0;t<nBands;t++) _runs.insert(_runs.end(),_tasks[t].runs.begin(),_tasks[t].runs.end());
+    _rowStarts.resize(grayImg.rows+1);
+    for(int y=0,r=0;y<=grayImg.rows;y++){
+        while(r<int(_runs.size()) && _runs[r].y<y) r++;
+        _rowStarts[y]=r;
+    }
+    //joins the runs of consecutive rows that touch, diagonally included. The root of a blob is always its first run
+    _parents.resize(_runs.size());
+    for(size_t i=0;i<_runs.size();i++) _parents[i]=int(i);
+    for(int y=1;y<grayImg.rows;y++){
+        int a=_rowStarts[y-1],b=_rowStarts[y];
+        while(a<_rowStarts[y] && b<_rowStarts[y+1]){
+            if(_runs[a].x1+1<_runs[b].x0) a++;
+            else if(_runs[b].x1+1<_runs[a].x0) b++;
+            else{
+                int rootA=findRoot(_parents,a),rootB=findRoot(_parents,b);
+                if(rootA<rootB) _parents[rootB]=rootA;
+                else if(rootB<rootA) _parents[rootA]=rootB;
+                if(_runs[a].x1<_runs[b].x1) a++;
+                else b++;
+            }
+        }
+    }
+    _labels.resize(_runs.size());
+    _blobs.clear();
+    for(int i=0;i<int(_runs.size());i++){
+        const Run &run=_runs[i];
+        int root=findRoot(_parents,i);
+        if(root==i){
+            _labels[i]=int(_blobs.size());
+            _blobs.push_back({i,run.x1-run.x0+1});
+        }
+        else{
+            _labels[i]=_labels[root];
+            _blobs[_labels[i]].area+=run.x1-run.x0+1;
+        }
+    }
+    findHoles(grayImg.rows,grayImg.cols);
+    /*a boundary visits a pixel at most once per branch of the blob leaving it, and a pixel has at most 4 branches, separated by background
+     *neighbours. So a blob with an outer or hole boundary of minContourSize pixels, whatever its shape, has at least a quarter of them
+     */
+    _boundaries.clear();
+    for(const Blob &blob:_blobs)
+        if(4*blob.area>=minContourSize) _boundaries.push_back({cv::Point(_runs[blob.run].x0,_runs[blob.run].y),blob.area,false});
+    for(int hole:_holes){
+        const Gap &gap=_gaps[hole];
+        const Blob &blob=_blobs[_labels[gap.run]];
+        if(4*blob.area>=minContourSize) _boundaries.push_back({cv::Point(gap.x0-1,_runs[gap.run].y),blob.area,true});
+    }
+    size_t nBoundaries=_boundaries.size();
+    if(stats){
+        stats->nContours+=_blobs.size()+_holes.size();
+        stats->nSmall+=_blobs.size()+_holes.size()-nBoundaries;
+        stats->contoursTime+=secondsSince(start);
+    }
+    int nTraceTasks=int(std::max(size_t(1),std::min(nBoundaries,size_t(nThreads))));
+    if(int(_tasks.size())<nTraceTasks) _tasks.resize(nTraceTasks);
+    struct TraceArgs{QuadSegmenter *segmenter;int minContourSize;bool collectStats;int nTasks;} traceArgs={this,minContourSize,stats!=nullptr,nTraceTasks};
+    runTasks(nTraceTasks,[&traceArgs](int t){
+        size_t n=traceArgs.segmenter->_boundaries.size();
+        traceArgs.segmenter->traceBoundaries(n*t/traceArgs.nTasks,n*(t+1)/traceArgs.nTasks,traceArgs.minContourSize,traceArgs.collectStats,traceArgs.segmenter->_tasks[t]);
+    },nThreads,executor);
+    for(int t=0;t<nTraceTasks;t++){
+        _quads.insert(_quads.end(),_tasks[t].quads.begin(),_tasks[t].quads.end());
+        if(stats) *stats+=_tasks[t].stats;
+    }
+}
+void QuadSegmenter::thresholdBand(const cv::Mat &grayImg,int y0,int y1,Task &task){
+    const int rows=grayImg.rows,cols=grayImg.cols;
+    //sums of the 7 rows around the current one, with 3 more columns on each side replicating the border ones as cv::adaptiveThreshold does
+    task.columnSums.resize(cols+6);
+    int *sums=task.columnSums.data()+3;
+    task.runs.clear();
+    for(int y=y0;y<y1;y++){
+        if(y==y0){
+            std::fill(sums,sums+cols,0);
+            for(int k=-3;k<=3;k++){
+                const uchar *row=grayImg.ptr<uchar>(std::max(0,std::min(rows-1,y+k)));
+                for(int x=0;x<cols;x++) sums[x]+=row[x];
+            }
+        }
+        else{
+            const uchar *added=grayImg.ptr<uchar>(std::min(rows-1,y+3)),*removed=grayImg.ptr<uchar>(std::max(0,y-4));
+            for(int x=0;x<cols;x++) sums[x]+=int(added[x])-int(removed[x]);
+        }
+        for(int k=1;k<=3;k++){
+            sums[-k]=sums[0];
+            sums[cols-1+k]=sums[cols-1];
+        }
+        const uchar *src=grayImg.ptr<uchar>(y);
+        uchar *dst=_binary.ptr<uchar>(y+1);
+        dst[0]=dst[cols+1]=0;
+        dst++;
+        int sum=sums[-3]+sums[-2]+sums[-1]+sums[0]+sums[1]+sums[2]+sums[3];
+        int runStart=-1;
+        for(int x=0;x<cols;x++){
+            //the 8 bit box filter rounds the mean to the nearest integer, and a sum of 49 pixels is never halfway between two
+            bool foreground=int(src[x])+7<=(sum+24)/49;
+            dst[x]=foreground?255:0;
+            if(foreground){
+                if(runStart<0) runStart=x;
+            }
+            else if(runStart>=0){
+                task.runs.push_back({runStart,x-1,y});
+                runStart=-1;
+            }
+            if(x+1<cols) sum+=sums[x+4]-sums[x-3];
+        }
+        if(runStart>=0) task.runs.push_back({runStart,cols-1,y});
+    }
+}
+void QuadSegmenter::findHoles(int rows,int cols){
+    //the gaps between the runs, joined when they overlap in consecutive rows. Those reaching the frame are outside every blob
+    _gaps.clear();
+    _outside.clear();
+    _gapRowStarts.resize(rows+1);
+    for(int y=0;y<rows;y++){
+        _gapRowStarts[y]=int(_gaps.size());
+        int x=0,left=-1;
+        for(int r=_rowStarts[y];r<_rowStarts[y+1];r++){
+            if(x<_runs[r].x0) _gaps.push_back({x,_runs[r].x0-1,left});
+            x=_runs[r].x1+1;
+            left=r;
+        }
+        if(x<cols) _gaps.push_back({x,cols-1,left});
+        for(size_t i=_outside.size();i<_gaps.size();i++)
+            _outside.push_back(y==0 || y==rows-1 || _gaps[i].run==-1 || _gaps[i].x1==cols-1);
+    }
+    _gapRowStarts[rows]=int(_gaps.size());
+    _gapParents.resize(_gaps.size());
+    for(size_t i=0;i<_gaps.size();i++) _gapParents[i]=int(i);
+    for(int y=1;y<rows;y++){
+        int a=_gapRowStarts[y-1],b=_gapRowStarts[y];
+        while(a<_gapRowStarts[y] && b<_gapRowStarts[y+1]){
+            if(_gaps[a].x1<_gaps[b].x0) a++;
+            else if(_gaps[b].x1<_gaps[a].x0) b++;
+            else{
+                int rootA=findRoot(_gapParents,a),rootB=findRoot(_gapParents,b);
+                if(rootA!=rootB){
+                    int root=std::min(rootA,rootB);
+                    _gapParents[rootA+rootB-root]=root;
+                    _outside[root]|=_outside[rootA+rootB-root];
+                }
+                if(_gaps[a].x1<_gaps[b].x1) a++;
+                else b++;
+            }
+        }
+    }
+    //the root of a hole is its first gap, whose first pixel has the blob around it on the left
+    _holes.clear();
+    for(int i=0;i<int(_gaps.size());i++)
+        if(_gapParents[i]==i && !_outside[i]) _holes.push_back(i);
+}
+void QuadSegmenter::traceBoundaries(size_t begin,size_t end,int minContourSize,bool collectStats,Task &task)const{
+    task.quads.clear();
+    task.stats=DetectorStats();
+    const uchar *binary=_binary.ptr<uchar>(1)+1;
+    for(size_t i=begin;i<end;i++){
+        const Boundary &boundary=_boundaries[i];
+        int64 start=collectStats?cv::getTickCount():0;
+        //the boundary is never longer than this, see segment. The limit only guards against a broken trace
+        bool traced=traceBoundary(binary,int(_binary.step),boundary.start,boundary.hole,size_t(4*boundary.area)+1,task.contour);
+        if(collectStats){
+            task.stats.contoursTime+=secondsSince(start);
+            start=cv::getTickCount();
+        }
+        if(!traced){
+            task.stats.nNotQuads++;
+            continue;
+        }
+        if(int(task.contour.size())<minContourSize){
+            task.stats.nSmall++;
+            continue;
+        }
+        cv::approxPolyDP(task.contour,task.approx,double(task.contour.size())*0.05,true);
+        bool isQuad=task.approx.size()==4 && cv::isContourConvex(task.approx);
+        if(collectStats) task.stats.polygonTime+=secondsSince(start);
+        if(!isQuad){
+            task.stats.nNotQuads++;
+            continue;
+        }
+        Quad quad;
+        std::copy(task.approx.begin(),task.approx.end(),quad.corners);
+        task.quads.push_back(quad);
+    }
+}
+int QuadSegmenter::findRoot(std::vector<int> &parents,int i){
+    while(parents[i]!=i){
+        parents[i]=parents[parents[i]];
+        i=parents[i];
+    }
+    return i;
+}
+bool QuadSegmenter::traceBoundary(const uchar *binary,int stride,cv::Point start,bool hole,size_t maxLength,std::vector<cv::Point> &contour){
+    //Moore neighbour tracing, clockwise. Directions are numbered clockwise starting from the right one
+    static const int dx[8]={1,1,0,-1,-1,-1,0,1},dy[8]={0,1,1,1,0,-1,-1,-1};
+    const int offsets[8]={1,stride+1,stride,stride-1,-1,-stride-1,-stride,-stride+1};
+    contour.clear();
+    contour.push_back(start);
+    const uchar *p=binary+start.y*stride+start.x;
+    //the neighbour the search starts from is background: the left one of the first pixel of a blob, the right one for a hole
+    const int outside=hole?0:4;
+    int dir=-1;
+    for(int k=1;k<8 && dir==-1;k++)
+        if(p[offsets[(outside+k)&7]]) dir=(outside+k)&7;
+    if(dir==-1) return true;
+    const int firstDir=dir;
+    cv::Point pt=start;
+    for(;;){
+        p+=offsets[dir];
+        pt.x+=dx[dir];
+        pt.y+=dy[dir];
+        //searches clockwise from the pixel we come from, which is part of the blob, so the search always ends
+        int back=(dir+4)&7;
+        dir=(back+1)&7;
+        while(!p[offsets[dir]]) dir=(dir+1)&7;
+        if(pt==start && dir==firstDir){
+            //cv::findContours follows the boundaries the other way, and cv::approxPolyDP depends on the order of the points
+            std::reverse(contour.begin()+1,contour.end());
+            return true;
+        }
+        if(contour.size()>=maxLength) return false;
+        contour.push_back(pt);
+    }
+}
+}
+std::pair<cv::Mat,cv::Mat> Marker::estimatePose(const cv::Mat &cameraMatrix,const cv::Mat &distCoeffs,double markerSize) const{
+    cv::Point3d markerCorners[4]={ {-markerSize/2.f,markerSize/2.f,0.f},{markerSize/2.f,markerSize/2.f,0.f},{markerSize/2.f,-markerSize/2.f,0.f},{-markerSize/2.f,-markerSize/2.f,0.f}};
     cv::Mat Rvec,Tvec;
-    cv::solvePnP(markerCorners,*this,cameraMatrix,distCoeffs,Rvec,Tvec,false,cv::SOLVEPNP_IPPE);
+    cv::solvePnP(cv::Mat(4,1,CV_64FC3,markerCorners),*this,cameraMatrix,distCoeffs,Rvec,Tvec,false,cv::SOLVEPNP_IPPE);
     return {Rvec,Tvec};
 }
+namespace _private {
+//the two rotations of a plane whose projection at the normalized point (p,q) has the jacobian J, as in cv::solvePnP(SOLVEPNP_IPPE)
+inline void ippeRotations(const double J[4],double p,double q,double R1[9],double R2[9]){
+    //Rv is the transpose of the rotation taking (p,q,1) to the z axis
+    double nrm=std::sqrt(p*p+q*q+1),ax=p/nrm,ay=q/nrm,az=1/nrm;
+    double d=1/(1+az);
+    double Rv[9]={1-ax*ax*d,-ax*ay*d,ax, -ax*ay*d,1-ay*ay*d,ay, -ax,-ay,1-(ax*ax+ay*ay)*d};
+    double b00=Rv[0]-p*Rv[6],b01=Rv[1]-p*Rv[7],b10=Rv[3]-q*Rv[6],b11=Rv[4]-q*Rv[7];
+    double dtinv=1/(b00*b11-b01*b10);
+    double binv00=dtinv*b11,binv01=-dtinv*b01,binv10=-dtinv*b10,binv11=dtinv*b00;
+    double a00=binv00*J[0]+binv01*J[2],a01=binv00*J[1]+binv01*J[3];
+    double a10=binv10*J[0]+binv11*J[2],a11=binv10*J[1]+binv11*J[3];
+    //largest singular value of A
+    double ata00=a00*a00+a01*a01,ata01=a00*a10+a01*a11,ata11=a10*a10+a11*a11;
+    double gamma=std::sqrt(0.5*(ata00+ata11+std::sqrt((ata00-ata11)*(ata00-ata11)+4*ata01*ata01)));
+    double r00=a00/gamma,r01=a01/gamma,r10=a10/gamma,r11=a11/gamma;
+    double b0=std::sqrt(std::max(0.,1-r00*r00-r10*r10)),b1=std::sqrt(std::max(0.,1-r01*r01-r11*r11));
+    if(-r00*r01-r10*r11<0) b1=-b1;
+    //the two solutions differ in the sign of the z components of the first two columns
+    double c0[3]={r00,r10,b0},c1[3]={r01,r11,b1};
+    for(int s=0;s<2;s++){
+        double *R=s==0?R1:R2;
+        double sign=s==0?1:-1;
+        double l0[3]={c0[0],c0[1],sign*c0[2]},l1[3]={c1[0],c1[1],sign*c1[2]};
+        double l2[3]={l0[1]*l1[2]-l0[2]*l1[1],l0[2]*l1[0]-l0[0]*l1[2],l0[0]*l1[1]-l0[1]*l1[0]};
+        for(int r=0;r<3;r++){
+            R[r*3+0]=Rv[r*3]*l0[0]+Rv[r*3+1]*l0[1]+Rv[r*3+2]*l0[2];
+            R[r*3+1]=Rv[r*3]*l1[0]+Rv[r*3+1]*l1[1]+Rv[r*3+2]*l1[2];
+            R[r*3+2]=Rv[r*3]*l2[0]+Rv[r*3+1]*l2[1]+Rv[r*3+2]*l2[2];
+        }
+    }
+}
+/** least squares translation of the plane points model, rotated by R, that project onto the normalized points. Returns the sum of the squared
+ * reprojection errors
+ */
+inline double planarTranslation(const double R[9],const cv::Point2d model[4],const cv::Point2f normalized[4],double t[3]){
+    double su=0,sv=0,suv2=0,b[3]={0,0,0};
+    for(int i=0;i<4;i++){
+        double u=normalized[i].x,v=normalized[i].y;
+        double a=R[0]*model[i].x+R[1]*model[i].y,bb=R[3]*model[i].x+R[4]*model[i].y,c=R[6]*model[i].x+R[7]*model[i].y;
+        su+=u;sv+=v;suv2+=u*u+v*v;
+        b[0]+=u*c-a;
+        b[1]+=v*c-bb;
+        b[2]-=u*(u*c-a)+v*(v*c-bb);
+    }
+    //the first two normal equations give tx and ty from tz
+    t[2]=(b[2]+(su*b[0]+sv*b[1])/4)/(suv2-(su*su+sv*sv)/4);
+    t[0]=(b[0]+su*t[2])/4;
+    t[1]=(b[1]+sv*t[2])/4;
+    double error=0;
+    for(int i=0;i<4;i++){
+        double x=R[0]*model[i].x+R[1]*model[i].y+t[0],y=R[3]*model[i].x+R[4]*model[i].y+t[1],z=R[6]*model[i].x+R[7]*model[i].y+t[2];
+        double du=x/z-normalized[i].x,dv=y/z-normalized[i].y;
+        error+=du*du+dv*dv;
+    }
+    return error;
+}
+//axis angle vector of a rotation matrix, as cv::Rodrigues
+inline cv::Vec3d rotationVector(const double R[9]){
+    double r[3]={(R[7]-R[5])/2,(R[2]-R[6])/2,(R[3]-R[1])/2};
+    double s=std::sqrt(r[0]*r[0]+r[1]*r[1]+r[2]*r[2]);
+    double c=std::max(-1.,std::min(1.,(R[0]+R[4]+R[8]-1)/2));
+    double theta=std::atan2(s,c);
+    if(s>1e-5) return cv::Vec3d(r[0]*theta/s,r[1]*theta/s,r[2]*theta/s);
+    if(c>0) return cv::Vec3d(r[0],r[1],r[2]);
+    //close to half a turn the axis comes from the symmetric part, R+R^T=2(cI+(1-c)aa^T)
+    int i=R[0]>=R[4] && R[0]>=R[8]?0:(R[4]>=R[8]?1:2);
+    double axis[3];
+    for(int k=0;k<3;k++) axis[k]=((R[k*3+i]+R[i*3+k])/2-(k==i?c:0))/(1-c);
+    double nrm=std::sqrt(axis[0]*axis[0]+axis[1]*axis[1]+axis[2]*axis[2]);
+    if(axis[0]*r[0]+axis[1]*r[1]+axis[2]*r[2]<0) nrm=-nrm;
+    return cv::Vec3d(axis[0]*theta/nrm,axis[1]*theta/nrm,axis[2]*theta/nrm);
+}
+}
+PoseEstimator::PoseEstimator(const cv::Mat &cameraMatrix,const cv::Mat &distCoeffs,double markerSize):_markerSize(markerSize){
+    cameraMatrix.convertTo(_cameraMatrix,CV_64F);
+    distCoeffs.copyTo(_distCoeffs);
+    _focalLength=(_cameraMatrix.at<double>(0,0)+_cameraMatrix.at<double>(1,1))/2;
+}
+void PoseEstimator::undistort(const std::vector<Marker> &markers){
+    _corners.clear();
+    for(const auto &marker:markers) _corners.insert(_corners.end(),marker.begin(),marker.end());
+    if(_corners.empty()) _normalized.clear();
+    else cv::undistortPoints(_corners,_normalized,_cameraMatrix,_distCoeffs);
+}
+void PoseEstimator::estimate(const std::vector<Marker> &markers,std::vector<MarkerPose> &poses){
+    undistort(markers);
+    poses.resize(markers.size());
+    for(size_t i=0;i<markers.size();i++){
+        MarkerPose &pose=poses[i];
+        pose.id=markers[i].id;
+        double R[9],t[3];
+        double error=solveIppe(&_normalized[4*i],R,t);
+        if(!(error<std::numeric_limits<double>::infinity())){
+            pose.rvec=pose.tvec=cv::Vec3d(0,0,0);
+            pose.reprojectionError=std::numeric_limits<double>::infinity();
+            continue;
+        }
+        pose.rvec=_private::rotationVector(R);
+        pose.tvec=cv::Vec3d(t[0],t[1],t[2]);
+        pose.reprojectionError=std::sqrt(error/4)*_focalLength;
+    }
+}
+double PoseEstimator::solveIppe(const cv::Point2f normalized[4],double R[9],double t[3])const{
+    const double s=_markerSize;
+    const cv::Point2d model[4]={{-s/2,s/2},{s/2,s/2},{s/2,-s/2},{-s/2,-s/2}};
+    //homography from the marker plane, composing the one from the unit square with the map from the plane to it
+    _private::Homography unit(normalized);
+    const double *Hu=unit.H;
+    double H[9];
+    for(int r=0;r<3;r++){
+        H[r*3+0]=Hu[r*3+0]/s;
+        H[r*3+1]=-Hu[r*3+1]/s;
+        H[r*3+2]=0.5*(Hu[r*3+0]+Hu[r*3+1])+Hu[r*3+2];
+    }
+    if(H[8]==0) return std::numeric_limits<double>::infinity();
+    //the projection of the marker center and the jacobian of the homography there
+    double p=H[2]/H[8],q=H[5]/H[8];
+    double J[4]={(H[0]-H[6]*p)/H[8],(H[1]-H[7]*p)/H[8],(H[3]-H[6]*q)/H[8],(H[4]-H[7]*q)/H[8]};
+    if(!(std::fabs(J[0]*J[3]-J[1]*J[2])>0)) return std::numeric_limits<double>::infinity();
+    double R1[9],R2[9],t1[3],t2[3];
+    _private::ippeRotations(J,p,q,R1,R2);
+    double error1=_private::planarTranslation(R1,model,normalized,t1);
+    double error2=_private::planarTranslation(R2,model,normalized,t2);
+    if(!(error1<=error2) && !(error2<error1)) return std::numeric_limits<double>::infinity();
+    bool first=error1<=error2;
+    std::copy(first?R1:R2,(first?R1:R2)+9,R);
+    std::copy(first?t1:t2,(first?t1:t2)+3,t);
+    return first?error1:error2;
+}
+int PoseEstimator::estimateBoard(const std::vector<Marker> &markers,const std::vector<BoardMarker> &board,cv::Vec3d &rvec,cv::Vec3d &tvec){
+    undistort(markers);
+    _boardObjectPoints.clear();
+    _boardImagePoints.clear();
+    int nUsed=0;
+    for(size_t i=0;i<markers.size();i++){
+        for(const auto &boardMarker:board){
+            if(boardMarker.id!=markers[i].id) continue;
+            _boardObjectPoints.insert(_boardObjectPoints.end(),boardMarker.corners,boardMarker.corners+4);
+            _boardImagePoints.insert(_boardImagePoints.end(),_normalized.begin()+4*i,_normalized.begin()+4*(i+1));
+            nUsed++;
+            break;
+        }
+    }
+    if(nUsed==0) return 0;
+    //the points are already undistorted and normalized, so the camera is the identity. rvec and tvec are written in place
+    static const cv::Matx33d identity(1,0,0, 0,1,0, 0,0,1);
+    cv::Mat rvecMat(3,1,CV_64F,rvec.val),tvecMat(3,1,CV_64F,tvec.val);
+    cv::solvePnP(_boardObjectPoints,_boardImagePoints,identity,cv::noArray(),rvecMat,tvecMat,false,cv::SOLVEPNP_ITERATIVE);
+    return nUsed;
+}
 void Marker::draw(cv::Mat &in, const cv::Scalar color) const{
     auto _to_string=[](int i){ std::stringstream str;str<<i;return str.str();};
     float flineWidth=  std::max(1.f, std::min(5.f, float(in.cols) / 500.f));
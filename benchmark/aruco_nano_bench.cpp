@@ -0,0 +1,230 @@
+/** Benchmark of the ArucoNano detector on synthetic scenes.
+ *
+ * Markers of the ARUCO_MIP_36h12 dictionary are rendered with random scale, rotation, perspective, contrast, blur, noise and count over a
+ * cluttered background, into images from VGA to 12MP. The scenes are generated from a fixed seed, so that runs are comparable. For each image
+ * size it reports the throughput, the latency percentiles, the recall, the false positives and the corner error, and with --stats the time
+ * and the candidates discarded per stage of the detector.
+ *
+ * With --compare it also checks that both segmentations find the same quads in every scene: those of all the cv::findContours boundaries,
+ * holes included, and those of the FUSED segmenter must be identical. It exits with 2 if they differ.
+ *
+ *   g++ -O3 -std=c++11 -I.. aruco_nano_bench.cpp -o aruco_nano_bench `pkg-config --cflags --libs opencv4`
+ *   ./aruco_nano_bench [--scenes n] [--repeat n] [--threads n] [--fused] [--decimation f] [--attempts n] [--stats] [--compare] [--save dir]
+ */
+#include "aruco_nano.h"
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+struct Scene{
+    cv::Mat image;
+    std::vector<aruconano::Marker> truth;
+};
+//background of smooth illumination changes plus clutter, some of it square, that produces candidates which are not markers
+static void renderBackground(cv::Mat &image,cv::RNG &rng){
+    cv::Mat coarse(4,4,CV_8UC1);
+    for(int y=0;y<coarse.rows;y++)
+        for(int x=0;x<coarse.cols;x++) coarse.at<uchar>(y,x)=uchar(rng.uniform(80,220));
+    cv::resize(coarse,image,image.size(),0,0,cv::INTER_CUBIC);
+    int nShapes=image.cols*image.rows/20000;
+    for(int i=0;i<nShapes;i++){
+        cv::Point p(rng.uniform(0,image.cols),rng.uniform(0,image.rows));
+        int size=rng.uniform(5,std::max(6,image.cols/15));
+        cv::Scalar color(rng.uniform(0,256));
+        switch(rng.uniform(0,3)){
+        case 0: cv::rectangle(image,p,p+cv::Point(size,rng.uniform(5,size+6)),color,rng.uniform(0,2)?cv::FILLED:2);break;
+        case 1: cv::circle(image,p,size/2,color,rng.uniform(0,2)?cv::FILLED:2);break;
+        default: cv::line(image,p,p+cv::Point(rng.uniform(-size,size),rng.uniform(-size,size)),color,rng.uniform(1,4));break;
+        }
+    }
+}
+static Scene renderScene(cv::Size size,int nMarkers,cv::RNG &rng){
+    Scene scene;
+    scene.image.create(size,CV_8UC1);
+    renderBackground(scene.image,rng);
+    //each marker gets its own slot of a grid, so that they do not overlap
+    int gridSize=int(std::ceil(std::sqrt(double(nMarkers))));
+    cv::Size2f slot(float(size.width)/gridSize,float(size.height)/gridSize);
+    float slotSize=std::min(slot.width,slot.height);
+    std::vector<int> slots(gridSize*gridSize),ids(250);
+    for(size_t i=0;i<slots.size();i++) slots[i]=int(i);
+    for(size_t i=0;i<ids.size();i++) ids[i]=int(i);
+    for(int i=0;i<nMarkers;i++){
+        std::swap(slots[i],slots[rng.uniform(i,int(slots.size()))]);
+        std::swap(ids[i],ids[rng.uniform(i,int(ids.size()))]);
+        //the marker with a white quiet zone of one cell, with a random contrast
+        const int cellSize=16;
+        cv::Mat marker=aruconano::MarkerDetector::markerImage(ids[i],cellSize),padded;
+        cv::copyMakeBorder(marker,padded,cellSize,cellSize,cellSize,cellSize,cv::BORDER_CONSTANT,cv::Scalar(255));
+        int black=rng.uniform(0,70),white=rng.uniform(std::max(black+60,160),256);
+        padded.convertTo(padded,CV_8U,(white-black)/255.,black);
+        //similarity within the slot plus a random perspective distortion of the corners. side includes the quiet zone
+        float side=rng.uniform(std::min(24.f,slotSize*0.3f),slotSize*0.5f)*10/8;
+        cv::Point2f center((slots[i]%gridSize+0.5f)*slot.width,(slots[i]/gridSize+0.5f)*slot.height);
+        float angle=rng.uniform(0.f,float(2*CV_PI)),perspective=rng.uniform(0.f,0.12f);
+        cv::Point2f src[4],dst[4];
+        const float unit[4][2]={{-1,-1},{1,-1},{1,1},{-1,1}};
+        for(int c=0;c<4;c++){
+            float ux=unit[c][0]*side/2+rng.uniform(-perspective,perspective)*side,uy=unit[c][1]*side/2+rng.uniform(-perspective,perspective)*side;
+            dst[c]=center+cv::Point2f(ux*std::cos(angle)-uy*std::sin(angle),ux*std::sin(angle)+uy*std::cos(angle));
+            src[c]=cv::Point2f((unit[c][0]+1)/2*padded.cols-0.5f,(unit[c][1]+1)/2*padded.rows-0.5f);
+        }
+        cv::Mat H=cv::getPerspectiveTransform(src,dst);
+        cv::warpPerspective(padded,scene.image,H,size,cv::INTER_LINEAR,cv::BORDER_TRANSPARENT);
+        //the corners of the black square, in the pixel center coordinates the detector uses
+        std::vector<cv::Point2f> corners={{cellSize-0.5f,cellSize-0.5f},{9*cellSize-0.5f,cellSize-0.5f},{9*cellSize-0.5f,9*cellSize-0.5f},{cellSize-0.5f,9*cellSize-0.5f}};
+        aruconano::Marker truth;
+        cv::perspectiveTransform(corners,truth,H);
+        truth.id=ids[i];
+        scene.truth.push_back(truth);
+    }
+    double sigma=rng.uniform(0.,1.5);
+    if(sigma>0.3) cv::GaussianBlur(scene.image,scene.image,cv::Size(0,0),sigma);
+    cv::Mat noise(size,CV_16SC1);
+    cv::randn(noise,0,rng.uniform(0.,8.));
+    cv::Mat noisy;
+    scene.image.convertTo(noisy,CV_16S);
+    noisy+=noise;
+    noisy.convertTo(scene.image,CV_8U);
+    return scene;
+}
+//corners of a quad in a canonical order, so that quads can be compared whatever corner their polygon starts at
+typedef std::array<int,8> QuadKey;
+static QuadKey quadKey(const cv::Point *corners){
+    std::array<cv::Point,4> sorted={{corners[0],corners[1],corners[2],corners[3]}};
+    std::sort(sorted.begin(),sorted.end(),[](const cv::Point &a,const cv::Point &b){return a.y<b.y || (a.y==b.y && a.x<b.x);});
+    QuadKey key;
+    for(int c=0;c<4;c++){
+        key[2*c]=sorted[c].x;
+        key[2*c+1]=sorted[c].y;
+    }
+    return key;
+}
+struct Comparison{
+    size_t nContourQuads=0,nFusedQuads=0,nDifferent=0;
+};
+//quads of the CONTOURS segmentation, as MarkerDetector computes them, against those of the FUSED one, at full resolution
+static void compareSegmentations(const cv::Mat &gray,Comparison &comparison){
+    cv::Mat thresholded;
+    cv::adaptiveThreshold(gray,thresholded,255.,cv::ADAPTIVE_THRESH_MEAN_C,cv::THRESH_BINARY_INV,7,7);
+    std::vector<std::vector<cv::Point>> contours;
+    cv::findContours(thresholded,contours,cv::RETR_LIST,cv::CHAIN_APPROX_NONE);
+    std::vector<QuadKey> contourQuads,fusedQuads,different;
+    std::vector<cv::Point> approx;
+    for(size_t i=0;i<contours.size();i++){
+        if(contours[i].size()<50) continue;
+        cv::approxPolyDP(contours[i],approx,double(contours[i].size())*0.05,true);
+        if(approx.size()==4 && cv::isContourConvex(approx)) contourQuads.push_back(quadKey(approx.data()));
+    }
+    aruconano::_private::QuadSegmenter segmenter;
+    segmenter.segment(gray,50,1,aruconano::DetectorParams::Executor());
+    for(const auto &quad:segmenter.quads()) fusedQuads.push_back(quadKey(quad.corners));
+    std::sort(contourQuads.begin(),contourQuads.end());
+    std::sort(fusedQuads.begin(),fusedQuads.end());
+    std::set_symmetric_difference(contourQuads.begin(),contourQuads.end(),fusedQuads.begin(),fusedQuads.end(),std::back_inserter(different));
+    comparison.nContourQuads+=contourQuads.size();
+    comparison.nFusedQuads+=fusedQuads.size();
+    comparison.nDifferent+=different.size();
+}
+static double percentile(std::vector<double> values,double p){
+    if(values.empty()) return 0;
+    size_t i=std::min(values.size()-1,size_t(p*values.size()));
+    std::nth_element(values.begin(),values.begin()+i,values.end());
+    return values[i];
+}
+int main(int argc,char **argv){
+    int nScenes=20,nRepeats=5;
+    bool printStats=false,compare=false,equivalent=true;
+    std::string saveDir;
+    aruconano::DetectorParams params;
+    for(int i=1;i<argc;i++){
+        std::string arg=argv[i];
+        bool hasValue=i+1<argc;
+        if(arg=="--scenes" && hasValue) nScenes=std::atoi(argv[++i]);
+        else if(arg=="--repeat" && hasValue) nRepeats=std::max(1,std::atoi(argv[++i]));
+        else if(arg=="--threads" && hasValue) params.nThreads=std::atoi(argv[++i]);
+        else if(arg=="--decimation" && hasValue) params.decimation=float(std::atof(argv[++i]));
+        else if(arg=="--attempts" && hasValue) params.maxAttemptsPerCandidate=unsigned(std::atoi(argv[++i]));
+        else if(arg=="--fused") params.segmentation=aruconano::DetectorParams::FUSED;
+        else if(arg=="--stats") printStats=true;
+        else if(arg=="--compare") compare=true;
+        else if(arg=="--save" && hasValue) saveDir=argv[++i];
+        else{
+            std::fprintf(stderr,"usage: %s [--scenes n] [--repeat n] [--threads n] [--fused] [--decimation f] [--attempts n] [--stats] [--compare] [--save dir]\n",argv[0]);
+            return 1;
+        }
+    }
+    params.collectStats=printStats;
+    struct Resolution{const char *name;cv::Size size;int maxMarkers;};
+    const Resolution resolutions[]={{"VGA",{640,480},10},{"720p",{1280,720},25},{"1080p",{1920,1080},50},{"12MP",{4000,3000},80}};
+    std::printf("%-6s %8s %8s %8s %8s %8s %8s %7s %6s %8s %8s\n","size","fps","MPix/s","p50 ms","p90 ms","p99 ms","max ms","recall","fp","err px","p95 err");
+    for(const Resolution &resolution:resolutions){
+        cv::RNG rng(1234);
+        aruconano::MarkerDetector detector(params);
+        std::vector<aruconano::Marker> markers;
+        std::vector<double> latencies,errors;
+        aruconano::DetectorStats totalStats;
+        Comparison comparison;
+        size_t nTruth=0,nFound=0,nFalse=0;
+        double totalTime=0;
+        for(int s=0;s<nScenes;s++){
+            Scene scene=renderScene(resolution.size,rng.uniform(1,resolution.maxMarkers+1),rng);
+            if(!saveDir.empty()) cv::imwrite(saveDir+"/"+resolution.name+"_"+std::to_string(s)+".png",scene.image);
+            if(compare) compareSegmentations(scene.image,comparison);
+            //the first call grows the buffers of the detector and the output, as the first frame of a video would
+            detector.detect(scene.image,markers);
+            for(int r=0;r<nRepeats;r++){
+                auto start=std::chrono::steady_clock::now();
+                detector.detect(scene.image,markers);
+                double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+                latencies.push_back(seconds*1000);
+                totalTime+=seconds;
+                totalStats+=detector.stats();
+            }
+            //a marker is found if its id is detected with all its corners within a few pixels
+            nTruth+=scene.truth.size();
+            for(const auto &marker:markers){
+                auto truth=std::find_if(scene.truth.begin(),scene.truth.end(),[&marker](const aruconano::Marker &t){return t.id==marker.id;});
+                if(truth==scene.truth.end()){
+                    nFalse++;
+                    continue;
+                }
+                double error=0;
+                for(int c=0;c<4;c++) error+=cv::norm(marker[c]-(*truth)[c])/4;
+                if(error<5){
+                    nFound++;
+                    errors.push_back(error);
+                }
+            }
+        }
+        double meanError=0;
+        for(double e:errors) meanError+=e/errors.size();
+        double nFrames=double(latencies.size());
+        std::printf("%-6s %8.1f %8.1f %8.2f %8.2f %8.2f %8.2f %6.1f%% %6zu %8.3f %8.3f\n",resolution.name,nFrames/totalTime,
+                    nFrames*resolution.size.area()/totalTime/1e6,percentile(latencies,0.5),percentile(latencies,0.9),percentile(latencies,0.99),
+                    percentile(latencies,1),100.*nFound/std::max(size_t(1),nTruth),nFalse,meanError,percentile(errors,0.95));
+        if(printStats){
+            //per frame averages
+            const aruconano::DetectorStats &st=totalStats;
+            std::printf("       ms: convert %.3f threshold %.3f contours %.3f polygon %.3f decode %.3f refine %.3f\n",st.convertTime*1000/nFrames,
+                        st.thresholdTime*1000/nFrames,st.contoursTime*1000/nFrames,st.polygonTime*1000/nFrames,st.decodeTime*1000/nFrames,st.refineTime*1000/nFrames);
+            std::printf("       candidates: %.0f contours, %.0f small, %.0f not quads, %.0f undecoded in %.0f attempts, %.1f duplicates, %.1f markers\n",
+                        st.nContours/nFrames,st.nSmall/nFrames,st.nNotQuads/nFrames,st.nUndecoded/nFrames,st.nDecodeAttempts/nFrames,
+                        st.nDuplicates/nFrames,st.nMarkers/nFrames);
+        }
+        if(compare){
+            std::printf("       quads: %zu contours, %zu fused, %zu in only one of them\n",comparison.nContourQuads,comparison.nFusedQuads,
+                        comparison.nDifferent);
+            equivalent=equivalent && comparison.nDifferent==0;
+        }
+    }
+    return equivalent?0:2;
+}
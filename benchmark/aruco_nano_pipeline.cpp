@@ -0,0 +1,143 @@
+/** Runs the ArucoNano Pipeline on video files or directories of images, one stream per source, and compares it with detecting the same frames
+ * serially with a single MarkerDetector.
+ *
+ * The frames are decoded into memory first, so that reading them does not limit the measurement. Each stream is then pushed from its own
+ * thread, as fast as the pipeline accepts them, or at --fps frames per second as live cameras would, counting the frames the pipeline rejects.
+ * It reports the throughput of both runs and, per stream, the frames delivered, dropped and rejected and the latency percentiles.
+ *
+ *   g++ -O3 -std=c++11 -pthread -I.. aruco_nano_pipeline.cpp -o aruco_nano_pipeline `pkg-config --cflags --libs opencv4`
+ *   ./aruco_nano_pipeline [--workers n] [--inflight n] [--budget ms] [--fps f] [--frames n] [--fused] video.mp4 images_dir ...
+ */
+#include "aruco_nano.h"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+//the frames of a video file, or the images of a directory in name order
+static std::vector<cv::Mat> readFrames(const std::string &source,size_t maxFrames){
+    std::vector<cv::Mat> frames;
+    std::vector<cv::String> files;
+    try{
+        cv::glob(source+"/*",files,false);
+    }catch(const cv::Exception &){}
+    if(files.empty()){
+        cv::VideoCapture video(source);
+        cv::Mat frame;
+        while(frames.size()<maxFrames && video.read(frame)) frames.push_back(frame.clone());
+        return frames;
+    }
+    std::sort(files.begin(),files.end());
+    for(const auto &file:files){
+        if(frames.size()>=maxFrames) break;
+        cv::Mat image=cv::imread(file);
+        if(!image.empty()) frames.push_back(image);
+    }
+    return frames;
+}
+static double percentile(std::vector<double> values,double p){
+    if(values.empty()) return 0;
+    size_t i=std::min(values.size()-1,size_t(p*values.size()));
+    std::nth_element(values.begin(),values.begin()+i,values.end());
+    return values[i];
+}
+struct StreamStats{
+    size_t nDelivered=0,nDropped=0,nRejected=0,nMarkers=0;
+    uint64_t nextFrame=0;
+    bool outOfOrder=false;
+    std::vector<double> latencies;
+};
+int main(int argc,char **argv){
+    aruconano::PipelineParams params;
+    aruconano::DetectorParams detectorParams;
+    double fps=0;
+    size_t maxFrames=300;
+    std::vector<std::string> sources;
+    for(int i=1;i<argc;i++){
+        std::string arg=argv[i];
+        bool hasValue=i+1<argc;
+        if(arg=="--workers" && hasValue) params.nWorkers=std::atoi(argv[++i]);
+        else if(arg=="--inflight" && hasValue) params.maxFramesInFlight=std::atoi(argv[++i]);
+        else if(arg=="--budget" && hasValue) params.latencyBudget=std::atof(argv[++i])/1000;
+        else if(arg=="--fps" && hasValue) fps=std::atof(argv[++i]);
+        else if(arg=="--frames" && hasValue) maxFrames=size_t(std::max(1,std::atoi(argv[++i])));
+        else if(arg=="--fused") detectorParams.segmentation=aruconano::DetectorParams::FUSED;
+        else if(arg.compare(0,2,"--")!=0) sources.push_back(arg);
+        else{
+            sources.clear();
+            break;
+        }
+    }
+    if(sources.empty()){
+        std::fprintf(stderr,"usage: %s [--workers n] [--inflight n] [--budget ms] [--fps f] [--frames n] [--fused] source ...\n",argv[0]);
+        return 1;
+    }
+    std::vector<std::vector<cv::Mat>> frames;
+    size_t nFrames=0;
+    for(const auto &source:sources){
+        frames.push_back(readFrames(source,maxFrames));
+        nFrames+=frames.back().size();
+        std::printf("%s: %zu frames\n",source.c_str(),frames.back().size());
+    }
+    if(nFrames==0) return 1;
+
+    //baseline: every frame detected in turn by a single detector
+    aruconano::MarkerDetector detector(detectorParams);
+    std::vector<aruconano::Marker> markers;
+    auto start=std::chrono::steady_clock::now();
+    for(size_t f=0;f<maxFrames;f++)
+        for(const auto &stream:frames)
+            if(f<stream.size()) detector.detect(stream[f],markers);
+    double serialTime=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    //each stream is only delivered by one thread, so its stats need no locking
+    params.nStreams=int(frames.size());
+    std::vector<StreamStats> stats(frames.size());
+    for(size_t s=0;s<frames.size();s++) stats[s].latencies.reserve(frames[s].size());
+    double pipelineTime;
+    {
+        aruconano::Pipeline pipeline(params,detectorParams,[&stats](const aruconano::FrameResult &result){
+            StreamStats &st=stats[result.stream];
+            if(result.frame!=st.nextFrame) st.outOfOrder=true;
+            st.nextFrame=result.frame+1;
+            if(result.dropped) st.nDropped++;
+            else{
+                st.nDelivered++;
+                st.nMarkers+=result.markers.size();
+                st.latencies.push_back(result.latency*1000);
+            }
+        });
+        start=std::chrono::steady_clock::now();
+        std::vector<std::thread> producers;
+        for(size_t s=0;s<frames.size();s++)
+            producers.emplace_back([&,s](){
+                auto next=std::chrono::steady_clock::now();
+                for(const auto &frame:frames[s]){
+                    if(fps>0){
+                        //a live camera does not wait: a frame the pipeline cannot take is lost
+                        std::this_thread::sleep_until(next);
+                        next+=std::chrono::microseconds(int64_t(1e6/fps));
+                        if(!pipeline.push(int(s),frame)) stats[s].nRejected++;
+                    }
+                    else while(!pipeline.push(int(s),frame)) std::this_thread::yield();
+                }
+            });
+        for(auto &producer:producers) producer.join();
+        pipeline.flush();
+        pipelineTime=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    }
+
+    std::printf("serial:   %8.1f fps\npipeline: %8.1f fps (%.2fx)\n",nFrames/serialTime,nFrames/pipelineTime,serialTime/pipelineTime);
+    std::printf("%-6s %9s %8s %8s %8s %8s %8s %8s\n","stream","delivered","dropped","rejected","markers","p50 ms","p99 ms","max ms");
+    for(size_t s=0;s<stats.size();s++){
+        const StreamStats &st=stats[s];
+        std::printf("%-6zu %9zu %8zu %8zu %8.1f %8.2f %8.2f %8.2f%s\n",s,st.nDelivered,st.nDropped,st.nRejected,double(st.nMarkers)/std::max(size_t(1),st.nDelivered),
+                    percentile(st.latencies,0.5),percentile(st.latencies,0.99),percentile(st.latencies,1),st.outOfOrder?"  OUT OF ORDER":"");
+    }
+    return 0;
+}